@@ -0,0 +1,65 @@
+#!/bin/sh
+# Synthetic makefile generator: writes DIR/bench.mk plus the source files
+# its leaf targets are built from. The shape is set through the environment:
+#
+#   TARGETS  total number of targets (default 10000)
+#   DEPTH    number of levels between the sources and 'all' (default 8)
+#   FANIN    prerequisites of each target on the level below (default 4)
+#   FANOUT   consecutive targets sharing one prerequisite set, i.e. how many
+#            dependents each prerequisite has (default 4)
+#   PATTERN  percentage of leaf targets built by a pattern rule (default 50)
+#   VARS     number of variables referenced by the recipes (default 100)
+#   CMD      command run by every recipe; 'touch' creates the targets so a
+#            second build is a no-op, 'true' only measures scheduling
+#
+#   $ TARGETS=50000 DEPTH=12 sh bench/gen_makefile.sh /tmp/bench
+
+DIR=${1:-.}
+mkdir -p "$DIR" || exit 1
+
+awk -v n="${TARGETS:-10000}" -v depth="${DEPTH:-8}" -v fanin="${FANIN:-4}" \
+    -v fanout="${FANOUT:-4}" -v pattern="${PATTERN:-50}" -v vars="${VARS:-100}" \
+    -v cmd="${CMD:-touch}" -v dir="$DIR" 'BEGIN {
+    if (depth < 1) depth = 1
+    if (vars < 1) vars = 1
+    if (fanout < 1) fanout = 1
+    width = int(n / depth)
+    if (width < 1) width = 1
+
+    for (v = 0; v < vars; v++)
+        printf "RUN%d = %s\n", v, cmd
+    print ""
+
+    printf "all:"
+    for (i = 0; i < width; i++)
+        printf " t%d_%d", depth - 1, i
+    print "\n"
+
+    print "%.o: %.in"
+    print "\t$(RUN0) $@\n"
+
+    # Level 0 consumes the generated sources, either through the pattern
+    # rule above or through an explicit rule of its own.
+    for (i = 0; i < width; i++) {
+        printf "" > (dir "/s" i ".in")
+        close(dir "/s" i ".in")
+        if (i * 100 < pattern * width) {
+            printf "t0_%d: s%d.o\n", i, i
+        } else {
+            printf "t0_%d: s%d.in\n", i, i
+        }
+        printf "\t$(RUN%d) $@\n", i % vars
+    }
+    print ""
+
+    for (level = 1; level < depth; level++) {
+        for (i = 0; i < width; i++) {
+            group = int(i / fanout)
+            printf "t%d_%d:", level, i
+            for (k = 0; k < fanin && k < width; k++)
+                printf " t%d_%d", level - 1, (group * fanin + k) % width
+            printf "\n\t$(RUN%d) $@\n", (level * width + i) % vars
+        }
+        print ""
+    }
+}' > "$DIR/bench.mk"
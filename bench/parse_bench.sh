@@ -0,0 +1,21 @@
+#!/bin/sh
+# Parse-throughput benchmark: generates a makefile with RULES rules
+# (default 50000) and reports how fast mymake's readMakefile parses it.
+#
+#   $ sh bench/parse_bench.sh [RULES]
+
+RULES=${1:-50000}
+MAKEFILE=${TMPDIR:-/tmp}/mymake_parse_bench.mk
+
+awk -v n="$RULES" 'BEGIN {
+    print "CC=gcc"
+    print "CFLAG := -O2 -Wall \\"
+    print "    -pedantic"
+    for (i = 0; i < n; i++) {
+        printf "obj%d.o: src%d.c hdr%d.h \\\n    common.h\n", i, i, i % 100
+        printf "\t$(CC) $(CFLAG) -DID=%d -c src%d.c -o obj%d.o\n", i, i, i
+    }
+}' > "$MAKEFILE"
+
+${MYMAKE:-./mymake} -f "$MAKEFILE" -p --stats | grep '^\[mymake\] Parsed'
+rm -f "$MAKEFILE"
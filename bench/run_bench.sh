@@ -0,0 +1,37 @@
+#!/bin/sh
+# Build benchmark: generates a synthetic makefile with gen_makefile.sh (same
+# environment variables) and runs a full build followed by a no-op build.
+# Reports the parse time of readMakefile, the graph build time, the time
+# spent executing the plan and the peak RSS, all taken from mymake --stats.
+#
+#   $ make bench
+#   $ TARGETS=50000 JOBS=8 sh bench/run_bench.sh
+
+MYMAKE=${MYMAKE:-./mymake}
+MYMAKE=$(cd "$(dirname "$MYMAKE")" && pwd)/$(basename "$MYMAKE")
+DIR=${TMPDIR:-/tmp}/mymake_bench.$$
+MYPATH=${MYPATH:-/usr/bin:/bin:}
+export MYPATH
+
+sh "$(dirname "$0")/gen_makefile.sh" "$DIR" || exit 1
+cd "$DIR" || exit 1
+echo "bench.mk: $(wc -c < bench.mk) bytes, ${TARGETS:-10000} targets, depth ${DEPTH:-8}, -j ${JOBS:-1}"
+printf '%-12s %10s %10s %12s %14s\n' "" "parse ms" "graph ms" "build ms" "peak RSS KB"
+
+status=0
+for run in full no-op; do
+    if ! "$MYMAKE" -f bench.mk -j "${JOBS:-1}" --stats > stats.txt 2>&1; then
+        tail -5 stats.txt
+        status=1
+        break
+    fi
+    awk -v run="$run" '
+        /^\[mymake\] Parsed / { for (i = 1; i < NF; i++) if ($i == "in") parse = $(i + 1) }
+        /^\[mymake\] Graph: / { for (i = 1; i < NF; i++) if ($i == "in") graph = $(i + 1) }
+        /^\[mymake\] Build: / { for (i = 1; i < NF; i++) { if ($i == "in") build = $(i + 1); if ($i == "RSS") rss = $(i + 1) } }
+        END { printf "%-12s %10.2f %10.2f %12.2f %14d\n", run " build", parse, graph, build, rss }
+    ' stats.txt
+done
+
+cd / && rm -rf "$DIR"
+exit $status
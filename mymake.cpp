@@ -5,16 +5,42 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <stdint.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <fstream>
 #include <sstream>
 #include <set>
 #include <fcntl.h>
-#include <regex>
+#include <spawn.h>
+#include <time.h>
+#include <glob.h>
+#include <dirent.h>
 #include <string.h>
+#include <queue>
+#include <deque>
+#include <cerrno>
+#include <algorithm>
 
 using namespace std;
 
+extern char **environ;
+
 struct Target
 {
     string name;
@@ -28,12 +54,111 @@ struct Rule
     vector<string> commands;
 };
 
-struct GenericRule
+struct BuildRecord
+{
+    struct timespec mtime;
+    uint64_t commandHash;
+    uint64_t outputHash;
+    uint64_t duration;
+    vector<string> prerequisites;
+    vector<string> dependencies;
+    vector<uint64_t> prerequisiteHashes;
+};
+
+struct Variable
+{
+    string value;
+    bool recursive;
+};
+
+struct AutomaticVariables
 {
     string target;
-    vector<string> ext;
     vector<string> prerequisites;
-    vector<string> commands;
+    vector<string> newerPrerequisites;
+    string stem;
+};
+
+struct TemplatePart
+{
+    bool dynamic;
+    string text;
+};
+
+typedef vector<TemplatePart> CommandTemplate;
+
+struct FileState
+{
+    bool exists;
+    struct timespec mtime;
+};
+
+struct OutputStream
+{
+    int readFd;
+    int writeFd;
+    int destination;
+    string buffer;
+};
+
+// A target's stdout and stderr while its commands run. Only the parent reads
+// the pipes, so what a job prints reaches the terminal in one piece.
+struct OutputCapture
+{
+    OutputStream streams[2];
+    int logFd;
+    bool active;
+};
+
+struct Pipeline
+{
+    vector<pid_t> stagePids;
+    size_t runningStages;
+    int exitStatus;
+    int killedBy;
+    OutputCapture *capture;
+};
+
+struct PatternRule
+{
+    string target;
+    vector<string> prerequisites;
+    const Rule *rule;
+};
+
+struct SuffixTrieNode
+{
+    unordered_map<char, size_t> children;
+    vector<size_t> patternRules;
+};
+
+struct PatternMatch
+{
+    const PatternRule *patternRule;
+    string stem;
+    vector<string> prerequisites;
+};
+
+struct TraceEvent
+{
+    string name;
+    string category;
+    string target;
+    long long start;
+    long long duration;
+    int slot;
+    double userMilliseconds;
+    double systemMilliseconds;
+    long maxResidentKilobytes;
+};
+
+struct Recipe
+{
+    const Rule *rule;
+    const PatternMatch *match;
+    const vector<string> *commands;
+    vector<string> prerequisites;
+    string stem;
 };
 
 string fileName = "mymake3.mk";
@@ -43,28 +168,93 @@ bool continueOnError = false;
 bool printDebugInfo = false;
 bool blockSIGINT = false;
 int timeoutSeconds = -1;
+int maxJobs = 1;
+bool printStats = false;
+bool hashMode = false;
+bool pipeFail = false;
 bool timeoutFlag = false;
 vector<Target> targets;
 vector<Rule> rules;
-unordered_map<string, string> variables;
-set<string> visited;
+unordered_map<string, Variable> variables;
+unordered_map<string, string> variableExpansions;
+unordered_map<string, CommandTemplate> commandTemplates;
+set<string> variablesBeingExpanded;
 vector<pid_t> childProcesses;
-vector<pid_t> childProcesses2;
-vector<GenericRule> genericRules;
+unordered_map<string, size_t> ruleIndex;
+vector<PatternRule> patternRules;
+vector<SuffixTrieNode> suffixTrie;
+unordered_map<string, PatternMatch> patternMatches;
+size_t maxImplicitChain = 4;
+string buildDatabaseFile = ".mymake_db";
+unordered_map<string, BuildRecord> buildRecords;
+bool buildDatabaseDirty = false;
+unordered_map<string, vector<string>> discoveredDependencies;
+unordered_map<string, uint64_t> measuredDurations;
+unordered_map<string, uint64_t> fileHashes;
+unordered_map<string, FileState> fileStates;
+size_t fileStateLookups = 0;
+size_t fileStateCalls = 0;
+const size_t fileStateBatchMinimum = 16;
+const unsigned fileStateRingEntries = 256;
+const size_t fileStateThreads = 16;
+vector<string> searchDirectories;
+unordered_map<string, string> searchIndex;
+bool searchIndexLoaded = false;
+string cacheDirectory = "";
+int cacheHits = 0;
+int cacheMisses = 0;
+int cacheStores = 0;
+string traceFile = "";
+struct timespec traceStart;
+vector<TraceEvent> traceEvents;
+unordered_map<pid_t, TraceEvent> tracedCommands;
+unordered_map<string, TraceEvent> tracedTargets;
+size_t traceSummaryCount = 10;
+double loadLimit = 0;
+uint64_t maxMemory = 0;
+string cgroupMemoryFile = "";
+deque<long long> recentJobStarts;
+bool throttleActive = false;
+unordered_map<string, int> ruleWeights;
+bool buildFailed = false;
+bool serverMode = false;
+string serverSocketPath = ".mymake.sock";
+const int serverDeclined = 255;
+int inotifyFd = -1;
+unordered_map<int, string> watchedDirectories;
+set<string> watchedDirectoryNames;
+set<string> dirtyPaths;
+unordered_set<string> knownUpToDate;
+bool makefileChanged = false;
+bool roundStale = false;
+bool watchMode = false;
+set<string> watchedFiles;
+int watchDebounceMilliseconds = 100;
+string outputSync = "none";
+string logDirectory = "";
+int outputEpollFd = -1;
+int childExitPipe[2] = {-1, -1};
+bool jobsGiven = false;
+string jobserverStyle = "pipe";
+string jobserverFifo = "";
+int jobserverPipe[2] = {-1, -1};
+string savedMakeflags = "";
+bool makeflagsSaved = false;
+int jobTokenReadFd = -1;
+int jobTokenWriteFd = -1;
+string jobTokens;
+string workerAddress = "";
+vector<string> remoteWorkers;
+vector<int> remoteWorkerJobs;
+unordered_set<string> localTargets;
+unordered_set<string> phonyTargets;
 
-void printGenericRules()
+void printPatternRules()
 {
-    for (GenericRule rule : genericRules)
+    for (const PatternRule &rule : patternRules)
     {
         cout << "Target: " << rule.target << endl;
 
-        cout << "Extensions:";
-        for (const string &extension : rule.ext)
-        {
-            cout << " " << extension;
-        }
-        cout << endl;
-
         cout << "Prerequisites:";
         for (const string &prereq : rule.prerequisites)
         {
@@ -73,7 +263,7 @@ void printGenericRules()
         cout << endl;
 
         cout << "Commands:";
-        for (const string &command : rule.commands)
+        for (const string &command : rule.rule->commands)
         {
             cout << " " << command;
         }
@@ -85,7 +275,7 @@ void printVariables()
 {
     for (const auto &entry : variables)
     {
-        cout << entry.first << " = " << entry.second << endl;
+        cout << entry.first << (entry.second.recursive ? " = " : " := ") << entry.second.value << endl;
     }
 }
 
@@ -161,7 +351,7 @@ void printRuleForTarget(const Rule &rule, int level)
     cout << endl;
 }
 
-void printCommand(const vector<char *> &cmdArgs)
+void printCommand(const vector<char *> &cmdArgs, ostream &output)
 {
     for (char *arg : cmdArgs)
     {
@@ -169,14 +359,42 @@ void printCommand(const vector<char *> &cmdArgs)
         {
             while (*arg != '\0')
             {
-                cout << *arg;
+                output << *arg;
                 arg++;
             }
-            cout << " ";
+            output << " ";
         }
     }
-    cout << endl;
-    cout.flush();
+    output << endl;
+}
+
+bool parseMemorySize(const char *text, uint64_t &bytes)
+{
+    char *end;
+    double value = strtod(text, &end);
+    uint64_t unit = 1;
+    if (*end == 'K' || *end == 'k')
+    {
+        unit = 1ULL << 10;
+    }
+    else if (*end == 'M' || *end == 'm')
+    {
+        unit = 1ULL << 20;
+    }
+    else if (*end == 'G' || *end == 'g')
+    {
+        unit = 1ULL << 30;
+    }
+    else if (*end != '\0')
+    {
+        return false;
+    }
+    if (unit != 1 && end[1] != '\0')
+    {
+        return false;
+    }
+    bytes = value * unit;
+    return end != text && value > 0;
 }
 
 void printDebugStats()
@@ -187,10 +405,54 @@ void printDebugStats()
     cout << "Continue on Error: " << (continueOnError ? "Yes" : "No") << endl;
     cout << "Print Debug Info: " << (printDebugInfo ? "Yes" : "No") << endl;
     cout << "Block SIGINT: " << (blockSIGINT ? "Yes" : "No") << endl;
-    cout << "Timeout Seconds: " << (timeoutSeconds == -1 ? "None" : to_string(timeoutSeconds)) << endl
+    cout << "Timeout Seconds: " << (timeoutSeconds == -1 ? "None" : to_string(timeoutSeconds)) << endl;
+    cout << "Pipefail: " << (pipeFail ? "Yes" : "No") << endl;
+    cout << "Hash Mode: " << (hashMode ? "Yes" : "No") << endl;
+    cout << "Cache Directory: " << (cacheDirectory.empty() ? "None" : cacheDirectory) << endl;
+    cout << "Print Stats: " << (printStats ? "Yes" : "No") << endl;
+    cout << "Server: " << (serverMode ? "Yes" : "No") << endl;
+    cout << "Watch: " << (watchMode ? "Yes" : "No") << endl;
+    cout << "Trace File: " << (traceFile.empty() ? "None" : traceFile) << endl;
+    cout << "Load Limit: " << (loadLimit > 0 ? to_string(loadLimit) : "None") << endl;
+    cout << "Max Memory: " << (maxMemory > 0 ? to_string(maxMemory >> 20) + " MB" : "None") << endl;
+    cout << "Output Sync: " << outputSync << endl;
+    cout << "Log Directory: " << (logDirectory.empty() ? "None" : logDirectory) << endl;
+    cout << "Jobserver Style: " << jobserverStyle << endl;
+    cout << "Worker: " << (workerAddress.empty() ? "No" : workerAddress) << endl;
+    cout << "Remote Workers: " << remoteWorkers.size() << endl;
+    cout << "Jobs: " << maxJobs << endl
          << endl;
 }
 
+// Puts every command-line option back to its default, so that a server
+// request is parsed as a fresh run. serverMode and watchMode are kept: they
+// describe the running process, not the request.
+void resetOptions()
+{
+    fileName = "mymake3.mk";
+    target = "";
+    buildRulesDatabase = false;
+    continueOnError = false;
+    printDebugInfo = false;
+    blockSIGINT = false;
+    timeoutSeconds = -1;
+    maxJobs = 1;
+    printStats = false;
+    hashMode = false;
+    pipeFail = false;
+    cacheDirectory = "";
+    traceFile = "";
+    loadLimit = 0;
+    maxMemory = 0;
+    outputSync = "none";
+    logDirectory = "";
+    jobsGiven = false;
+    jobserverStyle = "pipe";
+    workerAddress = "";
+    remoteWorkers.clear();
+    remoteWorkerJobs.clear();
+}
+
 bool validate(int argc, char *argv[])
 {
     for (int i = 1; i < argc; ++i)
@@ -237,6 +499,165 @@ bool validate(int argc, char *argv[])
                 return false;
             }
         }
+        else if (strcmp(argv[i], "--hash") == 0)
+        {
+            hashMode = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                cacheDirectory = argv[i + 1];
+                ++i;
+            }
+            else
+            {
+                cerr << "Error: --cache option requires a directory." << endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            printStats = true;
+        }
+        else if (strcmp(argv[i], "-l") == 0)
+        {
+            if (i + 1 < argc && atof(argv[i + 1]) > 0)
+            {
+                loadLimit = atof(argv[i + 1]);
+                ++i;
+            }
+            else
+            {
+                cerr << "Error: -l option requires a positive load average." << endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--max-mem") == 0)
+        {
+            if (i + 1 < argc && parseMemorySize(argv[i + 1], maxMemory))
+            {
+                ++i;
+            }
+            else
+            {
+                cerr << "Error: --max-mem option requires a size such as 512M or 4G." << endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--server") == 0)
+        {
+            serverMode = true;
+        }
+        else if (strcmp(argv[i], "--watch") == 0)
+        {
+            watchMode = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                traceFile = argv[i + 1];
+                ++i;
+            }
+            else
+            {
+                cerr << "Error: --trace option requires a file name." << endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--output-sync") == 0)
+        {
+            if (i + 1 < argc && (strcmp(argv[i + 1], "none") == 0 || strcmp(argv[i + 1], "line") == 0 || strcmp(argv[i + 1], "target") == 0))
+            {
+                outputSync = argv[i + 1];
+                ++i;
+            }
+            else
+            {
+                cerr << "Error: --output-sync option requires none, line or target." << endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--log-dir") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                logDirectory = argv[i + 1];
+                ++i;
+            }
+            else
+            {
+                cerr << "Error: --log-dir option requires a directory." << endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--jobserver-style") == 0)
+        {
+            if (i + 1 < argc && (strcmp(argv[i + 1], "fifo") == 0 || strcmp(argv[i + 1], "pipe") == 0))
+            {
+                jobserverStyle = argv[i + 1];
+                ++i;
+            }
+            else
+            {
+                cerr << "Error: --jobserver-style option requires fifo or pipe." << endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--worker") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                workerAddress = argv[i + 1];
+                ++i;
+            }
+            else
+            {
+                cerr << "Error: --worker option requires a [host:]port." << endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--remote") == 0)
+        {
+            if (i + 1 < argc)
+            {
+                istringstream list(argv[i + 1]);
+                string worker;
+                while (getline(list, worker, ','))
+                {
+                    if (!worker.empty())
+                    {
+                        remoteWorkers.push_back(worker);
+                    }
+                }
+                remoteWorkerJobs.assign(remoteWorkers.size(), 0);
+                ++i;
+            }
+            if (remoteWorkers.empty())
+            {
+                cerr << "Error: --remote option requires a list of host:port workers." << endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--pipefail") == 0)
+        {
+            pipeFail = true;
+        }
+        else if (strcmp(argv[i], "-j") == 0)
+        {
+            if (i + 1 < argc && atoi(argv[i + 1]) > 0)
+            {
+                maxJobs = atoi(argv[i + 1]);
+                jobsGiven = true;
+                ++i;
+            }
+            else
+            {
+                cerr << "Error: -j option requires a positive job count." << endl;
+                return false;
+            }
+        }
         else if (argv[i][0] != '-')
         {
             if (target.empty())
@@ -279,679 +700,5559 @@ string removeLeadingTrailingSpaces(const string &input)
     return input.substr(startPos, endPos - startPos);
 }
 
-void readMakefile(string fileName)
+double elapsedMilliseconds(const struct timespec &start)
 {
-    ifstream makefile(fileName);
-    string line;
-
-    Rule currentRule;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_nsec - start.tv_nsec) / 1000000.0;
+}
 
-    while (getline(makefile, line))
+vector<string> splitWords(const string &input)
+{
+    vector<string> words;
+    size_t pos = 0;
+    while (pos < input.size())
     {
-        line = removeLeadingTrailingSpaces(line);
-        if (line.empty() || (line.size() > 0 && line[0] == '#'))
+        while (pos < input.size() && isspace(static_cast<unsigned char>(input[pos])))
         {
-            continue;
+            pos++;
+        }
+        size_t start = pos;
+        while (pos < input.size() && !isspace(static_cast<unsigned char>(input[pos])))
+        {
+            pos++;
+        }
+        if (pos > start)
+        {
+            words.push_back(input.substr(start, pos - start));
         }
-        size_t pos = line.find('=');
+    }
+    return words;
+}
 
-        if (pos != string::npos)
+// Position of the first ':' or '=' outside $(...) / ${...} references.
+size_t findSeparator(const string &line)
+{
+    int depth = 0;
+    for (size_t i = 0; i < line.size(); ++i)
+    {
+        char ch = line[i];
+        if (ch == '(' || ch == '{')
         {
-            string variableName = line.substr(0, pos);
-            string variableValue = line.substr(pos + 1);
-            variables[variableName] = variableValue;
+            depth++;
         }
-        else if (line.find(":") != string::npos)
+        else if ((ch == ')' || ch == '}') && depth > 0)
         {
-            if (!currentRule.target.empty())
-            {
-                rules.push_back(currentRule);
-            }
-            currentRule = Rule();
-            currentRule.target = line.substr(0, line.find(":"));
-            string prerequisite;
-            istringstream iss(line.substr(line.find(":") + 1));
-            while (iss >> prerequisite)
-            {
-                currentRule.prerequisites.push_back(prerequisite);
-            }
+            depth--;
         }
-        else
+        else if (depth == 0 && (ch == ':' || ch == '='))
         {
-            if (!line.empty())
-            {
-                line = line.substr(line.find_first_not_of(" \t"));
-                line = line.erase(line.find_last_not_of(" \t") + 1);
-                currentRule.commands.push_back(line);
-            }
+            return i;
         }
     }
-    if (!currentRule.target.empty())
-    {
-        rules.push_back(currentRule);
-    }
-
-    makefile.close();
+    return string::npos;
+}
 
-    for (const Rule &rule : rules)
+string joinWords(const vector<string> &words)
+{
+    string joined;
+    for (const string &word : words)
     {
-        Target target;
-        target.name = rule.target;
-        target.prerequisites = rule.prerequisites;
-        targets.push_back(target);
+        if (!joined.empty())
+        {
+            joined += ' ';
+        }
+        joined += word;
     }
+    return joined;
 }
 
-vector<char *> buildCommandArgs(const string &command, const string &target, const string &prerequisite)
+// Index just past the variable reference or function call starting at text[dollar].
+size_t referenceEnd(const string &text, size_t dollar)
 {
-    vector<char *> cmdArgs;
-    istringstream iss(command);
-    string arg;
-
-    while (iss >> arg)
+    size_t pos = dollar + 1;
+    if (pos >= text.size())
+    {
+        return pos;
+    }
+    char open = text[pos];
+    if (open == '(' || open == '{')
     {
-        size_t pos;
-        string modifiedArg = arg;
-        if ((pos = modifiedArg.find('$')) != string::npos)
+        char close = open == '(' ? ')' : '}';
+        int depth = 0;
+        for (; pos < text.size(); ++pos)
         {
-            size_t start = pos + 1;
-            size_t end = modifiedArg.find(')', start);
-            if (end == string::npos)
-            {
-                end = modifiedArg.size();
-            }
-
-            string varName;
-            if (modifiedArg[start] == '(')
-            {
-                varName = modifiedArg.substr(start + 1, end - start - 1);
-            }
-            else
-            {
-                varName = modifiedArg.substr(start, end - start);
-            }
-
-            if (varName == "@")
-            {
-                modifiedArg.replace(pos, end - pos + 1, target);
-            }
-            else if (varName == "<")
+            if (text[pos] == open)
             {
-                modifiedArg.replace(pos, end - pos + 1, prerequisite);
+                depth++;
             }
-            else if (variables.find(varName) != variables.end())
+            else if (text[pos] == close && --depth == 0)
             {
-                modifiedArg.replace(pos, end - pos + 1, variables[varName]);
+                return pos + 1;
             }
         }
-
-        if (!modifiedArg.empty())
-        {
-            char *argChar = new char[modifiedArg.size() + 1];
-            strcpy(argChar, modifiedArg.c_str());
-            cmdArgs.push_back(argChar);
-        }
+        return text.size();
     }
-
-    cmdArgs.push_back(nullptr);
-
-    return cmdArgs;
+    while (pos < text.size() && (isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_'))
+    {
+        pos++;
+    }
+    return pos == dollar + 1 ? pos + 1 : pos;
 }
 
-char *searchCommand(const string &command)
+size_t findTopLevel(const string &text, char target, size_t start)
 {
-    if (command.front() == '/')
-    {
-        char *result = new char[command.size() + 1];
-        strcpy(result, command.c_str());
-        return result;
-    }
-    else
+    int depth = 0;
+    for (size_t i = start; i < text.size(); ++i)
     {
-        char *myPathEnv = getenv("MYPATH");
-        if (myPathEnv != nullptr)
+        if (text[i] == '(' || text[i] == '{')
         {
-            string myPath = myPathEnv;
-            size_t start = 0;
-            size_t end = myPath.find(':');
-
-            while (end != string::npos)
-            {
-                string path = myPath.substr(start, end - start);
-                string fullCommandPath = path + '/' + command;
-                if (access(fullCommandPath.c_str(), F_OK) == 0)
-                {
-                    char *result = new char[fullCommandPath.size() + 1];
-                    strcpy(result, fullCommandPath.c_str());
-                    return result;
-                }
-                start = end + 1;
-                end = myPath.find(':', start);
-            }
+            depth++;
         }
-        else
+        else if ((text[i] == ')' || text[i] == '}') && depth > 0)
         {
-            cerr << "Error: MYPATH environment variable is not set!" << endl;
+            depth--;
+        }
+        else if (depth == 0 && text[i] == target)
+        {
+            return i;
         }
-        char *result = new char[command.size() + 1];
-        strcpy(result, command.c_str());
-        return result;
     }
+    return string::npos;
 }
 
-string searchFile(const string &filename)
+bool matchPattern(const string &pattern, const string &word, string &stem)
 {
-    if (filename[0] == '/')
+    size_t percent = pattern.find('%');
+    if (percent == string::npos)
     {
-        return filename;
+        stem = "";
+        return pattern == word;
     }
-    else
+    size_t suffixLength = pattern.size() - percent - 1;
+    if (word.size() < pattern.size() - 1 ||
+        word.compare(0, percent, pattern, 0, percent) != 0 ||
+        word.compare(word.size() - suffixLength, suffixLength, pattern, percent + 1, suffixLength) != 0)
     {
-        const char *myPathEnv = getenv("MYPATH");
-        if (myPathEnv != nullptr)
-        {
-            std::string myPath = myPathEnv;
-            size_t start = 0;
-            size_t end = myPath.find(':');
-
-            while (end != string::npos)
+        return false;
+    }
+    stem = word.substr(percent, word.size() - percent - suffixLength);
+    return true;
+}
+
+string applyPattern(const string &pattern, const string &stem)
+{
+    size_t percent = pattern.find('%');
+    if (percent == string::npos)
+    {
+        return pattern;
+    }
+    return pattern.substr(0, percent) + stem + pattern.substr(percent + 1);
+}
+
+string patternSubstitute(const string &pattern, const string &replacement, const string &text)
+{
+    vector<string> words = splitWords(text);
+    for (string &word : words)
+    {
+        string stem;
+        if (matchPattern(pattern, word, stem))
+        {
+            word = applyPattern(replacement, stem);
+        }
+    }
+    return joinWords(words);
+}
+
+string directoryPart(const string &word)
+{
+    size_t slash = word.rfind('/');
+    return slash == string::npos ? "./" : word.substr(0, slash + 1);
+}
+
+string filePart(const string &word)
+{
+    size_t slash = word.rfind('/');
+    return slash == string::npos ? word : word.substr(slash + 1);
+}
+
+// Position of the suffix dot in the file part of word, or npos.
+size_t suffixPosition(const string &word)
+{
+    size_t dot = word.rfind('.');
+    size_t slash = word.rfind('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+    {
+        return string::npos;
+    }
+    return dot;
+}
+
+string expandText(const string &text, const AutomaticVariables *automatic, bool &cacheable);
+
+string automaticValue(char name, const AutomaticVariables &automatic)
+{
+    switch (name)
+    {
+    case '@':
+        return automatic.target;
+    case '<':
+        return automatic.prerequisites.empty() ? "" : automatic.prerequisites[0];
+    case '^':
+    {
+        vector<string> unique;
+        set<string> seen;
+        for (const string &prerequisite : automatic.prerequisites)
+        {
+            if (seen.insert(prerequisite).second)
+            {
+                unique.push_back(prerequisite);
+            }
+        }
+        return joinWords(unique);
+    }
+    case '+':
+        return joinWords(automatic.prerequisites);
+    case '?':
+        return joinWords(automatic.newerPrerequisites);
+    case '*':
+        return automatic.stem;
+    }
+    return "";
+}
+
+string lookupVariable(const string &name, const AutomaticVariables *automatic, bool &cacheable)
+{
+    if (!name.empty() && strchr("@<^+?*", name[0]) != nullptr &&
+        (name.size() == 1 || (name.size() == 2 && (name[1] == 'D' || name[1] == 'F'))))
+    {
+        if (automatic == nullptr)
+        {
+            cacheable = false;
+            return "";
+        }
+        string value = automaticValue(name[0], *automatic);
+        if (name.size() == 2)
+        {
+            vector<string> words = splitWords(value);
+            for (string &word : words)
+            {
+                word = name[1] == 'D' ? directoryPart(word) : filePart(word);
+                if (name[1] == 'D' && word.size() > 1)
+                {
+                    word.pop_back();
+                }
+            }
+            value = joinWords(words);
+        }
+        return value;
+    }
+
+    unordered_map<string, Variable>::const_iterator found = variables.find(name);
+    if (found == variables.end())
+    {
+        const char *environmentValue = getenv(name.c_str());
+        return environmentValue != nullptr ? environmentValue : "";
+    }
+    if (!found->second.recursive)
+    {
+        return found->second.value;
+    }
+    unordered_map<string, string>::const_iterator cached = variableExpansions.find(name);
+    if (cached != variableExpansions.end())
+    {
+        return cached->second;
+    }
+    if (variablesBeingExpanded.count(name) > 0)
+    {
+        cerr << "Error: Recursive variable '" << name << "' references itself." << endl;
+        return "";
+    }
+    variablesBeingExpanded.insert(name);
+    bool valueCacheable = true;
+    string value = expandText(found->second.value, automatic, valueCacheable);
+    variablesBeingExpanded.erase(name);
+    if (valueCacheable)
+    {
+        variableExpansions[name] = value;
+    }
+    else
+    {
+        cacheable = false;
+    }
+    return value;
+}
+
+bool isFunctionName(const string &name)
+{
+    static const set<string> functions = {
+        "subst", "patsubst", "strip", "findstring", "filter", "filter-out", "sort", "word", "words",
+        "firstword", "lastword", "dir", "notdir", "suffix", "basename", "addsuffix", "addprefix", "wildcard"};
+    return functions.count(name) > 0;
+}
+
+string callFunction(const string &name, const string &rawArguments, const AutomaticVariables *automatic, bool &cacheable)
+{
+    vector<string> args;
+    size_t start = 0;
+    while (true)
+    {
+        size_t comma = name == "strip" || name == "wildcard" || name == "words" || name == "firstword" || name == "lastword" ||
+                               name == "dir" || name == "notdir" || name == "suffix" || name == "basename" || name == "sort"
+                           ? string::npos
+                           : findTopLevel(rawArguments, ',', start);
+        args.push_back(expandText(rawArguments.substr(start, comma == string::npos ? string::npos : comma - start), automatic, cacheable));
+        if (comma == string::npos)
+        {
+            break;
+        }
+        start = comma + 1;
+    }
+    while (args.size() < 3)
+    {
+        args.push_back("");
+    }
+
+    vector<string> words = splitWords(args.back());
+    vector<string> result;
+    if (name == "subst")
+    {
+        string text = args[2];
+        if (!args[0].empty())
+        {
+            for (size_t pos = text.find(args[0]); pos != string::npos; pos = text.find(args[0], pos + args[1].size()))
+            {
+                text.replace(pos, args[0].size(), args[1]);
+            }
+        }
+        return text;
+    }
+    if (name == "patsubst")
+    {
+        return patternSubstitute(args[0], args[1], args[2]);
+    }
+    if (name == "findstring")
+    {
+        return args[1].find(args[0]) != string::npos ? args[0] : "";
+    }
+    if (name == "filter" || name == "filter-out")
+    {
+        vector<string> patterns = splitWords(args[0]);
+        for (const string &word : splitWords(args[1]))
+        {
+            bool matched = false;
+            string stem;
+            for (const string &pattern : patterns)
+            {
+                matched = matched || matchPattern(pattern, word, stem);
+            }
+            if (matched == (name == "filter"))
+            {
+                result.push_back(word);
+            }
+        }
+        return joinWords(result);
+    }
+    if (name == "word")
+    {
+        int index = atoi(args[0].c_str());
+        words = splitWords(args[1]);
+        return index > 0 && index <= static_cast<int>(words.size()) ? words[index - 1] : "";
+    }
+    if (name == "addsuffix" || name == "addprefix")
+    {
+        for (const string &word : splitWords(args[1]))
+        {
+            result.push_back(name == "addsuffix" ? word + args[0] : args[0] + word);
+        }
+        return joinWords(result);
+    }
+
+    words = splitWords(args[0]);
+    if (name == "strip")
+    {
+        return joinWords(words);
+    }
+    if (name == "sort")
+    {
+        set<string> sorted(words.begin(), words.end());
+        return joinWords(vector<string>(sorted.begin(), sorted.end()));
+    }
+    if (name == "words")
+    {
+        return to_string(words.size());
+    }
+    if (name == "firstword" || name == "lastword")
+    {
+        return words.empty() ? "" : (name == "firstword" ? words.front() : words.back());
+    }
+    if (name == "wildcard")
+    {
+        cacheable = false;
+        for (const string &pattern : words)
+        {
+            glob_t matches;
+            if (glob(pattern.c_str(), 0, nullptr, &matches) == 0)
+            {
+                for (size_t i = 0; i < matches.gl_pathc; ++i)
+                {
+                    result.push_back(matches.gl_pathv[i]);
+                }
+            }
+            globfree(&matches);
+        }
+        return joinWords(result);
+    }
+    for (const string &word : words)
+    {
+        size_t dot = suffixPosition(word);
+        if (name == "dir")
+        {
+            result.push_back(directoryPart(word));
+        }
+        else if (name == "notdir")
+        {
+            result.push_back(filePart(word));
+        }
+        else if (name == "suffix" && dot != string::npos)
+        {
+            result.push_back(word.substr(dot));
+        }
+        else if (name == "basename")
+        {
+            result.push_back(dot == string::npos ? word : word.substr(0, dot));
+        }
+    }
+    return joinWords(result);
+}
+
+string expandReference(const string &reference, const AutomaticVariables *automatic, bool &cacheable)
+{
+    if (reference.size() < 2)
+    {
+        return reference;
+    }
+    if (reference[1] == '$')
+    {
+        return "$";
+    }
+    if (reference[1] != '(' && reference[1] != '{')
+    {
+        return lookupVariable(reference.substr(1), automatic, cacheable);
+    }
+
+    string inner = reference.substr(2, reference.size() - 3);
+    size_t space = inner.find_first_of(" \t");
+    if (space != string::npos && isFunctionName(inner.substr(0, space)))
+    {
+        size_t argumentStart = inner.find_first_not_of(" \t", space);
+        return callFunction(inner.substr(0, space), argumentStart == string::npos ? "" : inner.substr(argumentStart), automatic, cacheable);
+    }
+    size_t colon = findTopLevel(inner, ':', 0);
+    size_t equals = colon == string::npos ? string::npos : findTopLevel(inner, '=', colon);
+    if (equals != string::npos)
+    {
+        string value = lookupVariable(expandText(inner.substr(0, colon), automatic, cacheable), automatic, cacheable);
+        string from = expandText(inner.substr(colon + 1, equals - colon - 1), automatic, cacheable);
+        string to = expandText(inner.substr(equals + 1), automatic, cacheable);
+        if (from.find('%') == string::npos)
+        {
+            from = "%" + from;
+            to = "%" + to;
+        }
+        return patternSubstitute(from, to, value);
+    }
+    return lookupVariable(expandText(inner, automatic, cacheable), automatic, cacheable);
+}
+
+// Expands every variable reference and function call in text. cacheable is
+// cleared when the result depends on automatic variables or the filesystem.
+string expandText(const string &text, const AutomaticVariables *automatic, bool &cacheable)
+{
+    size_t dollar = text.find('$');
+    if (dollar == string::npos)
+    {
+        return text;
+    }
+    string result = text.substr(0, dollar);
+    while (dollar != string::npos)
+    {
+        size_t end = referenceEnd(text, dollar);
+        result += expandReference(text.substr(dollar, end - dollar), automatic, cacheable);
+        dollar = text.find('$', end);
+        result.append(text, end, dollar == string::npos ? string::npos : dollar - end);
+    }
+    return result;
+}
+
+// Splits a command into text that expands the same for every target and the
+// references that must be expanded per target.
+const CommandTemplate &compileCommandTemplate(const string &command)
+{
+    unordered_map<string, CommandTemplate>::const_iterator found = commandTemplates.find(command);
+    if (found != commandTemplates.end())
+    {
+        return found->second;
+    }
+    CommandTemplate compiled;
+    TemplatePart literal;
+    literal.dynamic = false;
+    size_t pos = 0;
+    while (pos < command.size())
+    {
+        size_t dollar = command.find('$', pos);
+        literal.text.append(command, pos, dollar == string::npos ? string::npos : dollar - pos);
+        if (dollar == string::npos)
+        {
+            break;
+        }
+        size_t end = referenceEnd(command, dollar);
+        string reference = command.substr(dollar, end - dollar);
+        bool cacheable = true;
+        string value = expandReference(reference, nullptr, cacheable);
+        if (cacheable)
+        {
+            literal.text += value;
+        }
+        else
+        {
+            if (!literal.text.empty())
+            {
+                compiled.push_back(literal);
+                literal.text.clear();
+            }
+            TemplatePart dynamicPart;
+            dynamicPart.dynamic = true;
+            dynamicPart.text = reference;
+            compiled.push_back(dynamicPart);
+        }
+        pos = end;
+    }
+    if (!literal.text.empty())
+    {
+        compiled.push_back(literal);
+    }
+    return commandTemplates[command] = compiled;
+}
+
+string expandCommand(const string &command, const AutomaticVariables &automatic)
+{
+    string expanded;
+    for (const TemplatePart &part : compileCommandTemplate(command))
+    {
+        if (part.dynamic)
+        {
+            bool cacheable = true;
+            expanded += expandReference(part.text, &automatic, cacheable);
+        }
+        else
+        {
+            expanded += part.text;
+        }
+    }
+    return expanded;
+}
+
+void clearExpansionCaches()
+{
+    variableExpansions.clear();
+    commandTemplates.clear();
+}
+
+void assignVariable(const string &name, const string &value, char op)
+{
+    bool cacheable = true;
+    unordered_map<string, Variable>::iterator found = variables.find(name);
+    clearExpansionCaches();
+    if (op == '?' && found != variables.end())
+    {
+        return;
+    }
+    if (op == '+' && found != variables.end())
+    {
+        Variable &current = found->second;
+        string appended = current.recursive ? value : expandText(value, nullptr, cacheable);
+        current.value = current.value.empty() ? appended : current.value + " " + appended;
+        return;
+    }
+    Variable variable;
+    variable.recursive = op != ':';
+    variable.value = variable.recursive ? value : expandText(value, nullptr, cacheable);
+    variables[name] = variable;
+}
+
+// Reads one logical line, joining backslash-newline continuations.
+// Returns the number of physical lines consumed.
+int readLogicalLine(const char *&cursor, const char *end, string &line)
+{
+    int physicalLines = 0;
+    line.clear();
+    while (cursor < end)
+    {
+        const char *newline = static_cast<const char *>(memchr(cursor, '\n', end - cursor));
+        const char *lineEnd = newline != nullptr ? newline : end;
+        const char *contentEnd = lineEnd;
+        if (contentEnd > cursor && contentEnd[-1] == '\r')
+        {
+            contentEnd--;
+        }
+        const char *start = cursor;
+        cursor = newline != nullptr ? newline + 1 : end;
+        physicalLines++;
+        if (physicalLines > 1)
+        {
+            while (start < contentEnd && (*start == ' ' || *start == '\t'))
+            {
+                start++;
+            }
+        }
+        if (contentEnd > start && contentEnd[-1] == '\\')
+        {
+            line.append(start, contentEnd - 1 - start);
+            while (!line.empty() && (line.back() == ' ' || line.back() == '\t'))
+            {
+                line.pop_back();
+            }
+            line += ' ';
+            continue;
+        }
+        line.append(start, contentEnd - start);
+        break;
+    }
+    return physicalLines;
+}
+
+void parseMakefile(const string &fileName, const char *data, size_t size)
+{
+    const char *cursor = data;
+    const char *end = data + size;
+    vector<size_t> currentRules;
+    int lineNumber = 0;
+    string line;
+
+    while (cursor < end)
+    {
+        bool recipe = *cursor == '\t';
+        int firstLine = lineNumber + 1;
+        lineNumber += readLogicalLine(cursor, end, line);
+
+        if (recipe && !currentRules.empty())
+        {
+            string command = removeLeadingTrailingSpaces(line);
+            if (!command.empty())
+            {
+                for (size_t rule : currentRules)
+                {
+                    rules[rule].commands.push_back(command);
+                }
+            }
+            continue;
+        }
+
+        size_t comment = line.find('#');
+        if (comment != string::npos)
+        {
+            line.erase(comment);
+        }
+        line = removeLeadingTrailingSpaces(line);
+        if (line.empty())
+        {
+            continue;
+        }
+
+        size_t separator = findSeparator(line);
+        if (separator == string::npos || recipe)
+        {
+            if (!currentRules.empty())
+            {
+                for (size_t rule : currentRules)
+                {
+                    rules[rule].commands.push_back(line);
+                }
+            }
+            else
+            {
+                cerr << "Error: " << fileName << ":" << firstLine << ": missing separator, line ignored." << endl;
+            }
+            continue;
+        }
+
+        if (line[separator] == '=' || line.compare(separator, 2, ":=") == 0 || line.compare(separator, 3, "::=") == 0)
+        {
+            char op = '=';
+            size_t nameEnd = separator;
+            size_t valueStart = separator + 1;
+            if (line[separator] == ':')
+            {
+                op = ':';
+                valueStart = line.find('=', separator) + 1;
+            }
+            else if (separator > 0 && (line[separator - 1] == '+' || line[separator - 1] == '?'))
+            {
+                op = line[separator - 1];
+                nameEnd--;
+            }
+            assignVariable(removeLeadingTrailingSpaces(line.substr(0, nameEnd)), removeLeadingTrailingSpaces(line.substr(valueStart)), op);
+            continue;
+        }
+
+        string prerequisites = line.substr(separator + 1);
+        if (!prerequisites.empty() && prerequisites[0] == ':')
+        {
+            prerequisites.erase(0, 1);
+        }
+        string inlineCommand = "";
+        size_t semicolon = prerequisites.find(';');
+        if (semicolon != string::npos)
+        {
+            inlineCommand = removeLeadingTrailingSpaces(prerequisites.substr(semicolon + 1));
+            prerequisites.erase(semicolon);
+        }
+
+        currentRules.clear();
+        bool cacheable = true;
+        vector<string> prerequisiteNames = splitWords(expandText(prerequisites, nullptr, cacheable));
+        for (const string &name : splitWords(expandText(line.substr(0, separator), nullptr, cacheable)))
+        {
+            Rule rule;
+            rule.target = name;
+            rule.prerequisites = prerequisiteNames;
+            if (!inlineCommand.empty())
+            {
+                rule.commands.push_back(inlineCommand);
+            }
+            currentRules.push_back(rules.size());
+            rules.push_back(move(rule));
+        }
+    }
+}
+
+bool readMakefile(string fileName)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        cerr << "Error: Cannot open makefile " << fileName << ": " << strerror(errno) << endl;
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1)
+    {
+        perror("Error reading makefile");
+        close(fd);
+        return false;
+    }
+    size_t size = fileStat.st_size;
+    void *mapped = MAP_FAILED;
+    if (size > 0)
+    {
+        mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            perror("Error mapping makefile");
+            close(fd);
+            return false;
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    if (mapped != MAP_FAILED)
+    {
+        parseMakefile(fileName, static_cast<const char *>(mapped), size);
+        munmap(mapped, size);
+    }
+
+    for (const Rule &rule : rules)
+    {
+        Target target;
+        target.name = rule.target;
+        target.prerequisites = rule.prerequisites;
+        targets.push_back(target);
+    }
+
+    if (printStats)
+    {
+        double milliseconds = elapsedMilliseconds(start);
+        double throughput = milliseconds > 0 ? size / 1048576.0 / (milliseconds / 1000.0) : 0;
+        printdebugInfoLine("mymake", "Parsed " + fileName + ": " + to_string(size) + " bytes, " + to_string(rules.size()) + " rules, " +
+                                         to_string(variables.size()) + " variables in " + to_string(milliseconds) + " ms (" + to_string(throughput) + " MB/s)",
+                           0);
+    }
+    return true;
+}
+
+// File-state layer. Every existence and mtime query goes through fileState,
+// so each path is stat'ed once per build; a target's entry is dropped when it
+// is rebuilt. prefetchFileStates fills the table for many paths at once with
+// io_uring statx submissions, or from a small thread pool when io_uring is
+// not available.
+FileState statFileState(const string &path)
+{
+    FileState state;
+    struct statx info;
+    state.exists = statx(AT_FDCWD, path.c_str(), 0, STATX_MTIME, &info) == 0;
+    state.mtime.tv_sec = state.exists ? info.stx_mtime.tv_sec : 0;
+    state.mtime.tv_nsec = state.exists ? info.stx_mtime.tv_nsec : 0;
+    return state;
+}
+
+const FileState &fileState(const string &path)
+{
+    fileStateLookups++;
+    unordered_map<string, FileState>::iterator found = fileStates.find(path);
+    if (found == fileStates.end())
+    {
+        fileStateCalls++;
+        found = fileStates.insert(make_pair(path, statFileState(path))).first;
+    }
+    return found->second;
+}
+
+bool fileExists(const string &path)
+{
+    return fileState(path).exists;
+}
+
+void forgetFileState(const string &path)
+{
+    fileStates.erase(path);
+}
+
+struct StatRing
+{
+    int fd;
+    unsigned entries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+};
+
+void closeStatRing(StatRing &ring)
+{
+    if (ring.sqRing != MAP_FAILED)
+    {
+        munmap(ring.sqRing, ring.sqRingSize);
+    }
+    if (ring.cqRing != MAP_FAILED)
+    {
+        munmap(ring.cqRing, ring.cqRingSize);
+    }
+    if (ring.sqes != MAP_FAILED)
+    {
+        munmap(ring.sqes, ring.sqesSize);
+    }
+    close(ring.fd);
+}
+
+// Sets up a ring with the raw syscalls, as no liburing is assumed.
+bool openStatRing(StatRing &ring)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, fileStateRingEntries, &params);
+    if (ring.fd == -1)
+    {
+        return false;
+    }
+    ring.entries = params.sq_entries;
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqRing = mmap(nullptr, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cqRing = mmap(nullptr, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES));
+    if (ring.sqRing == MAP_FAILED || ring.cqRing == MAP_FAILED || ring.sqes == MAP_FAILED)
+    {
+        closeStatRing(ring);
+        return false;
+    }
+    char *sq = static_cast<char *>(ring.sqRing);
+    char *cq = static_cast<char *>(ring.cqRing);
+    ring.sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    ring.sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring.sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring.sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    ring.cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring.cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring.cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+}
+
+// Keeps up to a ring's worth of IORING_OP_STATX requests in flight. Returns
+// false if the kernel cannot run them (io_uring disabled, or older than 5.6
+// so that every statx completes with -EINVAL); the caller then falls back.
+bool statWithRing(const vector<string> &paths, vector<FileState> &states)
+{
+    StatRing ring;
+    if (!openStatRing(ring))
+    {
+        return false;
+    }
+    // The kernel writes into results until each request completes, so on a
+    // hard error with requests still in flight the buffer is left allocated.
+    vector<struct statx> *results = new vector<struct statx>(paths.size());
+    size_t submitted = 0;
+    size_t completed = 0;
+    bool supported = true;
+    bool broken = false;
+    while (completed < paths.size() && !broken)
+    {
+        unsigned tail = *ring.sqTail;
+        while (supported && submitted < paths.size() && submitted - completed < ring.entries)
+        {
+            unsigned index = tail & *ring.sqMask;
+            struct io_uring_sqe &sqe = ring.sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_STATX;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = reinterpret_cast<uintptr_t>(paths[submitted].c_str());
+            sqe.len = STATX_MTIME;
+            sqe.off = reinterpret_cast<uintptr_t>(&(*results)[submitted]);
+            sqe.user_data = submitted;
+            ring.sqArray[index] = index;
+            tail++;
+            submitted++;
+        }
+        __atomic_store_n(ring.sqTail, tail, __ATOMIC_RELEASE);
+        unsigned pending = tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ring.fd, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0) == -1 && errno != EINTR)
+        {
+            broken = true;
+            break;
+        }
+        unsigned head = *ring.cqHead;
+        while (head != __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+        {
+            const struct io_uring_cqe &cqe = ring.cqes[head & *ring.cqMask];
+            FileState &state = states[cqe.user_data];
+            const struct statx &info = (*results)[cqe.user_data];
+            state.exists = cqe.res == 0;
+            state.mtime.tv_sec = state.exists ? info.stx_mtime.tv_sec : 0;
+            state.mtime.tv_nsec = state.exists ? info.stx_mtime.tv_nsec : 0;
+            supported = supported && cqe.res != -EINVAL;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+        if (!supported && completed == submitted)
+        {
+            break;
+        }
+    }
+    closeStatRing(ring);
+    if (completed == submitted)
+    {
+        delete results;
+    }
+    return supported && !broken;
+}
+
+struct StatBatch
+{
+    const vector<string> *paths;
+    vector<FileState> *states;
+    size_t next;
+};
+
+void *statBatchWorker(void *argument)
+{
+    StatBatch *batch = static_cast<StatBatch *>(argument);
+    size_t index;
+    while ((index = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) < batch->paths->size())
+    {
+        (*batch->states)[index] = statFileState((*batch->paths)[index]);
+    }
+    return nullptr;
+}
+
+void statWithThreads(const vector<string> &paths, vector<FileState> &states)
+{
+    StatBatch batch = {&paths, &states, 0};
+    vector<pthread_t> threads;
+    for (size_t i = 0; i < fileStateThreads && i * fileStateBatchMinimum < paths.size(); ++i)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, nullptr, statBatchWorker, &batch) != 0)
+        {
+            break;
+        }
+        threads.push_back(thread);
+    }
+    statBatchWorker(&batch);
+    for (pthread_t thread : threads)
+    {
+        pthread_join(thread, nullptr);
+    }
+}
+
+void prefetchFileStates(const vector<string> &paths)
+{
+    vector<string> missing;
+    unordered_set<string> seen;
+    for (const string &path : paths)
+    {
+        if (fileStates.count(path) == 0 && seen.insert(path).second)
+        {
+            missing.push_back(path);
+        }
+    }
+    if (missing.size() < fileStateBatchMinimum)
+    {
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    vector<FileState> states(missing.size());
+    string backend = "io_uring";
+    if (!statWithRing(missing, states))
+    {
+        backend = "threads";
+        statWithThreads(missing, states);
+    }
+    for (size_t i = 0; i < missing.size(); ++i)
+    {
+        fileStates[missing[i]] = states[i];
+    }
+    fileStateCalls += missing.size();
+    if (printStats)
+    {
+        printdebugInfoLine("mymake", "Prefetched " + to_string(missing.size()) + " file states (" + backend + ") in " +
+                                         to_string(elapsedMilliseconds(start)) + " ms",
+                           0);
+    }
+}
+
+bool getModificationTime(const string &path, struct timespec &mtime)
+{
+    const FileState &state = fileState(path);
+    if (!state.exists)
+    {
+        return false;
+    }
+    mtime = state.mtime;
+    return true;
+}
+
+bool isNewer(const struct timespec &first, const struct timespec &second)
+{
+    if (first.tv_sec != second.tv_sec)
+    {
+        return first.tv_sec > second.tv_sec;
+    }
+    return first.tv_nsec > second.tv_nsec;
+}
+
+bool isOutOfDate(const string &target, const vector<string> &prerequisites)
+{
+    struct timespec targetTime;
+    if (!getModificationTime(target, targetTime))
+    {
+        return true;
+    }
+    for (const string &prerequisite : prerequisites)
+    {
+        struct timespec prerequisiteTime;
+        if (!getModificationTime(prerequisite, prerequisiteTime) || isNewer(prerequisiteTime, targetTime))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+AutomaticVariables makeAutomaticVariables(const string &target, const vector<string> &prerequisites, const string &stem)
+{
+    AutomaticVariables automatic;
+    automatic.target = target;
+    automatic.prerequisites = prerequisites;
+    automatic.stem = stem;
+    struct timespec targetTime;
+    bool targetExists = getModificationTime(target, targetTime);
+    for (const string &prerequisite : prerequisites)
+    {
+        struct timespec prerequisiteTime;
+        if (!targetExists || !getModificationTime(prerequisite, prerequisiteTime) || isNewer(prerequisiteTime, targetTime))
+        {
+            automatic.newerPrerequisites.push_back(prerequisite);
+        }
+    }
+    return automatic;
+}
+
+void printUpToDate(const string &target, int level)
+{
+    if (level == 0)
+    {
+        printdebugInfoLine("mymake", "'" + target + "' is up to date.", 0);
+    }
+    else if (printDebugInfo)
+    {
+        printdebugInfoLine(target, "Up to date " + target, level);
+    }
+}
+
+vector<char *> buildCommandArgs(const string &command)
+{
+    vector<char *> cmdArgs;
+    for (const string &arg : splitWords(command))
+    {
+        char *argChar = new char[arg.size() + 1];
+        strcpy(argChar, arg.c_str());
+        cmdArgs.push_back(argChar);
+    }
+
+    cmdArgs.push_back(nullptr);
+
+    return cmdArgs;
+}
+
+uint64_t hashString(const string &value, uint64_t hash = 14695981039346656037ULL)
+{
+    for (unsigned char ch : value)
+    {
+        hash ^= ch;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// $? is left empty so the hash does not change with which prerequisites were newer.
+uint64_t hashCommands(const vector<string> &commands, const AutomaticVariables &automatic)
+{
+    AutomaticVariables stable = automatic;
+    stable.newerPrerequisites.clear();
+    uint64_t hash = hashString("");
+    for (const string &command : commands)
+    {
+        hash = hashString(expandCommand(command, stable) + "\n", hash);
+    }
+    return hash;
+}
+
+const uint64_t xxPrime1 = 11400714785074694791ULL;
+const uint64_t xxPrime2 = 14029467366897019727ULL;
+const uint64_t xxPrime3 = 1609587929392839161ULL;
+const uint64_t xxPrime4 = 9650029242287828579ULL;
+const uint64_t xxPrime5 = 2870177450012600261ULL;
+
+uint64_t rotateLeft(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t readLittleEndian(const unsigned char *data, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        value |= static_cast<uint64_t>(data[i]) << (8 * i);
+    }
+    return value;
+}
+
+uint64_t xxHashRound(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * xxPrime2;
+    accumulator = rotateLeft(accumulator, 31);
+    return accumulator * xxPrime1;
+}
+
+uint64_t xxHashMerge(uint64_t hash, uint64_t accumulator)
+{
+    hash ^= xxHashRound(0, accumulator);
+    return hash * xxPrime1 + xxPrime4;
+}
+
+// XXH64 with seed 0.
+uint64_t xxHash64(const unsigned char *data, size_t length)
+{
+    const unsigned char *end = data + length;
+    uint64_t hash;
+    if (length >= 32)
+    {
+        uint64_t v1 = xxPrime1 + xxPrime2;
+        uint64_t v2 = xxPrime2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -xxPrime1;
+        while (end - data >= 32)
+        {
+            v1 = xxHashRound(v1, readLittleEndian(data, 8));
+            v2 = xxHashRound(v2, readLittleEndian(data + 8, 8));
+            v3 = xxHashRound(v3, readLittleEndian(data + 16, 8));
+            v4 = xxHashRound(v4, readLittleEndian(data + 24, 8));
+            data += 32;
+        }
+        hash = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        hash = xxHashMerge(hash, v1);
+        hash = xxHashMerge(hash, v2);
+        hash = xxHashMerge(hash, v3);
+        hash = xxHashMerge(hash, v4);
+    }
+    else
+    {
+        hash = xxPrime5;
+    }
+    hash += length;
+    while (end - data >= 8)
+    {
+        hash ^= xxHashRound(0, readLittleEndian(data, 8));
+        hash = rotateLeft(hash, 27) * xxPrime1 + xxPrime4;
+        data += 8;
+    }
+    if (end - data >= 4)
+    {
+        hash ^= readLittleEndian(data, 4) * xxPrime1;
+        hash = rotateLeft(hash, 23) * xxPrime2 + xxPrime3;
+        data += 4;
+    }
+    while (data < end)
+    {
+        hash ^= *data * xxPrime5;
+        hash = rotateLeft(hash, 11) * xxPrime1;
+        ++data;
+    }
+    hash ^= hash >> 33;
+    hash *= xxPrime2;
+    hash ^= hash >> 29;
+    hash *= xxPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+bool hashFile(const string &path, uint64_t &hash)
+{
+    unordered_map<string, uint64_t>::const_iterator cached = fileHashes.find(path);
+    if (cached != fileHashes.end())
+    {
+        hash = cached->second;
+        return true;
+    }
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1)
+    {
+        close(fd);
+        return false;
+    }
+    unordered_map<string, BuildRecord>::const_iterator record = buildRecords.find(path);
+    if (record != buildRecords.end() && record->second.outputHash != 0 &&
+        record->second.mtime.tv_sec == fileStat.st_mtim.tv_sec && record->second.mtime.tv_nsec == fileStat.st_mtim.tv_nsec)
+    {
+        close(fd);
+        hash = record->second.outputHash;
+    }
+    else if (fileStat.st_size == 0)
+    {
+        close(fd);
+        hash = xxHash64(nullptr, 0);
+    }
+    else
+    {
+        void *mapped = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            perror("Error mapping file for hashing");
+            return false;
+        }
+        hash = xxHash64(static_cast<const unsigned char *>(mapped), fileStat.st_size);
+        munmap(mapped, fileStat.st_size);
+    }
+    fileHashes[path] = hash;
+    return true;
+}
+
+const char buildDatabaseMagic[8] = {'M', 'Y', 'M', 'A', 'K', 'E', 'D', 'B'};
+const uint32_t buildDatabaseVersion = 4;
+
+bool readDatabaseValue(const char *&cursor, const char *end, void *value, size_t size)
+{
+    if (static_cast<size_t>(end - cursor) < size)
+    {
+        return false;
+    }
+    memcpy(value, cursor, size);
+    cursor += size;
+    return true;
+}
+
+bool readDatabaseString(const char *&cursor, const char *end, string &value)
+{
+    uint32_t length;
+    if (!readDatabaseValue(cursor, end, &length, sizeof(length)) || static_cast<size_t>(end - cursor) < length)
+    {
+        return false;
+    }
+    value.assign(cursor, length);
+    cursor += length;
+    return true;
+}
+
+void appendDatabaseValue(string &buffer, const void *value, size_t size)
+{
+    buffer.append(static_cast<const char *>(value), size);
+}
+
+void appendDatabaseString(string &buffer, const string &value)
+{
+    uint32_t length = value.size();
+    appendDatabaseValue(buffer, &length, sizeof(length));
+    buffer += value;
+}
+
+void loadBuildDatabase()
+{
+    int fd = open(buildDatabaseFile.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        return;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) == -1 || fileStat.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+    void *mapped = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        perror("Error mapping build database");
+        return;
+    }
+
+    const char *cursor = static_cast<const char *>(mapped);
+    const char *end = cursor + fileStat.st_size;
+    char magic[sizeof(buildDatabaseMagic)];
+    uint32_t version = 0;
+    uint32_t count = 0;
+    bool valid = readDatabaseValue(cursor, end, magic, sizeof(magic)) &&
+                 memcmp(magic, buildDatabaseMagic, sizeof(magic)) == 0 &&
+                 readDatabaseValue(cursor, end, &version, sizeof(version));
+    if (valid && version != buildDatabaseVersion)
+    {
+        munmap(mapped, fileStat.st_size);
+        return;
+    }
+    valid = valid && readDatabaseValue(cursor, end, &count, sizeof(count));
+    for (uint32_t i = 0; valid && i < count; ++i)
+    {
+        string name;
+        BuildRecord record;
+        int64_t seconds = 0;
+        int64_t nanoseconds = 0;
+        uint32_t prerequisiteCount = 0;
+        uint32_t dependencyCount = 0;
+        uint32_t hashCount = 0;
+        valid = readDatabaseString(cursor, end, name) &&
+                readDatabaseValue(cursor, end, &seconds, sizeof(seconds)) &&
+                readDatabaseValue(cursor, end, &nanoseconds, sizeof(nanoseconds)) &&
+                readDatabaseValue(cursor, end, &record.commandHash, sizeof(record.commandHash)) &&
+                readDatabaseValue(cursor, end, &record.outputHash, sizeof(record.outputHash)) &&
+                readDatabaseValue(cursor, end, &record.duration, sizeof(record.duration)) &&
+                readDatabaseValue(cursor, end, &prerequisiteCount, sizeof(prerequisiteCount));
+        for (uint32_t j = 0; valid && j < prerequisiteCount; ++j)
+        {
+            string prerequisite;
+            valid = readDatabaseString(cursor, end, prerequisite);
+            record.prerequisites.push_back(prerequisite);
+        }
+        valid = valid && readDatabaseValue(cursor, end, &dependencyCount, sizeof(dependencyCount));
+        for (uint32_t j = 0; valid && j < dependencyCount; ++j)
+        {
+            string dependency;
+            valid = readDatabaseString(cursor, end, dependency);
+            record.dependencies.push_back(dependency);
+        }
+        valid = valid && readDatabaseValue(cursor, end, &hashCount, sizeof(hashCount));
+        for (uint32_t j = 0; valid && j < hashCount; ++j)
+        {
+            uint64_t prerequisiteHash = 0;
+            valid = readDatabaseValue(cursor, end, &prerequisiteHash, sizeof(prerequisiteHash));
+            record.prerequisiteHashes.push_back(prerequisiteHash);
+        }
+        record.mtime.tv_sec = seconds;
+        record.mtime.tv_nsec = nanoseconds;
+        if (valid)
+        {
+            buildRecords[name] = record;
+        }
+    }
+    munmap(mapped, fileStat.st_size);
+
+    if (!valid)
+    {
+        buildRecords.clear();
+        printdebugInfoLine("mymake", "Ignoring unreadable build database " + buildDatabaseFile, 0);
+    }
+}
+
+void saveBuildDatabase()
+{
+    if (!buildDatabaseDirty)
+    {
+        return;
+    }
+    string buffer;
+    uint32_t count = buildRecords.size();
+    appendDatabaseValue(buffer, buildDatabaseMagic, sizeof(buildDatabaseMagic));
+    appendDatabaseValue(buffer, &buildDatabaseVersion, sizeof(buildDatabaseVersion));
+    appendDatabaseValue(buffer, &count, sizeof(count));
+    for (const auto &entry : buildRecords)
+    {
+        const BuildRecord &record = entry.second;
+        int64_t seconds = record.mtime.tv_sec;
+        int64_t nanoseconds = record.mtime.tv_nsec;
+        uint32_t prerequisiteCount = record.prerequisites.size();
+        uint32_t dependencyCount = record.dependencies.size();
+        uint32_t hashCount = record.prerequisiteHashes.size();
+        appendDatabaseString(buffer, entry.first);
+        appendDatabaseValue(buffer, &seconds, sizeof(seconds));
+        appendDatabaseValue(buffer, &nanoseconds, sizeof(nanoseconds));
+        appendDatabaseValue(buffer, &record.commandHash, sizeof(record.commandHash));
+        appendDatabaseValue(buffer, &record.outputHash, sizeof(record.outputHash));
+        appendDatabaseValue(buffer, &record.duration, sizeof(record.duration));
+        appendDatabaseValue(buffer, &prerequisiteCount, sizeof(prerequisiteCount));
+        for (const string &prerequisite : record.prerequisites)
+        {
+            appendDatabaseString(buffer, prerequisite);
+        }
+        appendDatabaseValue(buffer, &dependencyCount, sizeof(dependencyCount));
+        for (const string &dependency : record.dependencies)
+        {
+            appendDatabaseString(buffer, dependency);
+        }
+        appendDatabaseValue(buffer, &hashCount, sizeof(hashCount));
+        for (uint64_t prerequisiteHash : record.prerequisiteHashes)
+        {
+            appendDatabaseValue(buffer, &prerequisiteHash, sizeof(prerequisiteHash));
+        }
+    }
+
+    string tempFile = buildDatabaseFile + ".tmp";
+    int fd = open(tempFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1)
+    {
+        perror("Error writing build database");
+        return;
+    }
+    size_t written = 0;
+    while (written < buffer.size())
+    {
+        ssize_t bytes = write(fd, buffer.data() + written, buffer.size() - written);
+        if (bytes == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error writing build database");
+            close(fd);
+            unlink(tempFile.c_str());
+            return;
+        }
+        written += bytes;
+    }
+    close(fd);
+    if (rename(tempFile.c_str(), buildDatabaseFile.c_str()) == -1)
+    {
+        perror("Error writing build database");
+        unlink(tempFile.c_str());
+        return;
+    }
+    buildDatabaseDirty = false;
+}
+
+// Hashes cover the prerequisites followed by the discovered dependencies.
+bool prerequisiteContentsChanged(const BuildRecord &record)
+{
+    if (record.prerequisiteHashes.size() != record.prerequisites.size() + record.dependencies.size())
+    {
+        return true;
+    }
+    for (size_t i = 0; i < record.prerequisiteHashes.size(); ++i)
+    {
+        const string &path = i < record.prerequisites.size() ? record.prerequisites[i] : record.dependencies[i - record.prerequisites.size()];
+        uint64_t hash;
+        if (!hashFile(path, hash) || hash != record.prerequisiteHashes[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool needsRebuild(const string &target, const vector<string> &prerequisites, uint64_t commandHash)
+{
+    unordered_map<string, BuildRecord>::const_iterator found = buildRecords.find(target);
+    if (!hashMode || found == buildRecords.end())
+    {
+        if (isOutOfDate(target, prerequisites))
+        {
+            return true;
+        }
+        if (found != buildRecords.end() && isOutOfDate(target, found->second.dependencies))
+        {
+            if (printDebugInfo)
+            {
+                printdebugInfoLine(target, "Discovered dependency changed since last build", 0);
+            }
+            return true;
+        }
+    }
+    else if (!fileExists(target))
+    {
+        return true;
+    }
+    if (found == buildRecords.end())
+    {
+        return false;
+    }
+    if (found->second.commandHash != commandHash || found->second.prerequisites != prerequisites)
+    {
+        if (printDebugInfo)
+        {
+            printdebugInfoLine(target, "Commands or prerequisites changed since last build", 0);
+        }
+        return true;
+    }
+    if (hashMode && prerequisiteContentsChanged(found->second))
+    {
+        if (printDebugInfo)
+        {
+            printdebugInfoLine(target, "Prerequisite contents changed since last build", 0);
+        }
+        return true;
+    }
+    return false;
+}
+
+// Reads a depfile as written by -MD/-MMD and returns the files listed for
+// its first rule; the phony header rules added by -MP are ignored.
+vector<string> readDepfile(const string &path)
+{
+    vector<string> dependencies;
+    ifstream input(path.c_str());
+    if (!input)
+    {
+        return dependencies;
+    }
+    stringstream contents;
+    contents << input.rdbuf();
+    string text = contents.str();
+    bool afterColon = false;
+    string word;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        char ch = text[i];
+        bool hasNext = i + 1 < text.size();
+        if (ch == '\\' && hasNext && (text[i + 1] == '\n' || text[i + 1] == '\r'))
+        {
+            i += (text[i + 1] == '\r' && i + 2 < text.size() && text[i + 2] == '\n') ? 2 : 1;
+            ch = ' ';
+        }
+        else if (ch == '\\' && hasNext && (text[i + 1] == ' ' || text[i + 1] == '#'))
+        {
+            word += text[++i];
+            continue;
+        }
+        else if (ch == '$' && hasNext && text[i + 1] == '$')
+        {
+            word += text[++i];
+            continue;
+        }
+        if (ch == ':' && !afterColon && (!hasNext || isspace(static_cast<unsigned char>(text[i + 1]))))
+        {
+            afterColon = true;
+            word.clear();
+            continue;
+        }
+        if (!isspace(static_cast<unsigned char>(ch)))
+        {
+            word += ch;
+            continue;
+        }
+        if (afterColon && !word.empty())
+        {
+            dependencies.push_back(word);
+        }
+        word.clear();
+        if (afterColon && ch == '\n')
+        {
+            break;
+        }
+    }
+    if (afterColon && !word.empty())
+    {
+        dependencies.push_back(word);
+    }
+    return dependencies;
+}
+
+// Finds the depfile a recipe writes: the -MF argument, or the output name
+// with a .d extension when only -MD or -MMD is given.
+string findDepfile(const string &target, const vector<string> &commands, const AutomaticVariables &automatic)
+{
+    bool writesDepfile = false;
+    string output = target;
+    for (const string &command : commands)
+    {
+        vector<string> words = splitWords(expandCommand(command, automatic));
+        for (size_t i = 0; i < words.size(); ++i)
+        {
+            if (words[i] == "-MF" && i + 1 < words.size())
+            {
+                return words[i + 1];
+            }
+            if (words[i].compare(0, 3, "-MF") == 0 && words[i].size() > 3)
+            {
+                return words[i].substr(3);
+            }
+            if (words[i] == "-MD" || words[i] == "-MMD")
+            {
+                writesDepfile = true;
+            }
+            else if (words[i] == "-o" && i + 1 < words.size())
+            {
+                output = words[i + 1];
+            }
+        }
+    }
+    if (!writesDepfile)
+    {
+        return "";
+    }
+    size_t dot = output.rfind('.');
+    size_t slash = output.rfind('/');
+    if (dot != string::npos && (slash == string::npos || dot > slash))
+    {
+        output.erase(dot);
+    }
+    return output + ".d";
+}
+
+// Picks up the header edges of a successful build; recordBuild stores them
+// with the target so later runs need not read the depfile again.
+void discoverDependencies(const string &target, const vector<string> &prerequisites, const vector<string> &commands, const AutomaticVariables &automatic)
+{
+    string depfile = findDepfile(target, commands, automatic);
+    if (depfile.empty())
+    {
+        return;
+    }
+    vector<string> &dependencies = discoveredDependencies[target];
+    dependencies.clear();
+    for (const string &dependency : readDepfile(depfile))
+    {
+        if (dependency != target &&
+            find(prerequisites.begin(), prerequisites.end(), dependency) == prerequisites.end() &&
+            find(dependencies.begin(), dependencies.end(), dependency) == dependencies.end())
+        {
+            dependencies.push_back(dependency);
+        }
+    }
+    if (printDebugInfo)
+    {
+        printdebugInfoLine(target, "Read " + to_string(dependencies.size()) + " dependencies from " + depfile, 0);
+    }
+}
+
+// A failed build is recorded with a zero command hash so the next run retries it.
+void recordBuild(const string &target, const vector<string> &prerequisites, uint64_t commandHash)
+{
+    BuildRecord record;
+    forgetFileState(target);
+    if (!getModificationTime(target, record.mtime))
+    {
+        buildDatabaseDirty = buildRecords.erase(target) > 0 || buildDatabaseDirty;
+        return;
+    }
+    record.commandHash = commandHash;
+    record.outputHash = 0;
+    record.duration = 0;
+    record.prerequisites = prerequisites;
+    unordered_map<string, BuildRecord>::const_iterator previous = buildRecords.find(target);
+    unordered_map<string, vector<string>>::iterator discovered = discoveredDependencies.find(target);
+    if (discovered != discoveredDependencies.end())
+    {
+        record.dependencies.swap(discovered->second);
+        discoveredDependencies.erase(discovered);
+    }
+    else if (previous != buildRecords.end())
+    {
+        record.dependencies = previous->second.dependencies;
+    }
+    unordered_map<string, uint64_t>::iterator measured = measuredDurations.find(target);
+    if (measured != measuredDurations.end() && commandHash != 0)
+    {
+        record.duration = measured->second;
+        measuredDurations.erase(measured);
+    }
+    else if (previous != buildRecords.end())
+    {
+        record.duration = previous->second.duration;
+    }
+    fileHashes.erase(target);
+    if (hashMode)
+    {
+        for (const string &prerequisite : prerequisites)
+        {
+            uint64_t hash = 0;
+            hashFile(prerequisite, hash);
+            record.prerequisiteHashes.push_back(hash);
+        }
+        for (const string &dependency : record.dependencies)
+        {
+            uint64_t hash = 0;
+            hashFile(dependency, hash);
+            record.prerequisiteHashes.push_back(hash);
+        }
+        buildRecords.erase(target);
+        hashFile(target, record.outputHash);
+    }
+    buildRecords[target] = record;
+    buildDatabaseDirty = true;
+}
+
+bool copyFile(const string &from, const string &to)
+{
+    int input = open(from.c_str(), O_RDONLY);
+    if (input == -1)
+    {
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(input, &fileStat) == -1)
+    {
+        close(input);
+        return false;
+    }
+    int output = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, fileStat.st_mode & 07777);
+    if (output == -1)
+    {
+        close(input);
+        return false;
+    }
+    bool copied = ioctl(output, FICLONE, input) == 0;
+    if (!copied)
+    {
+        char buffer[65536];
+        ssize_t bytes;
+        copied = true;
+        while ((bytes = read(input, buffer, sizeof(buffer))) != 0)
+        {
+            if (bytes == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                copied = false;
+                break;
+            }
+            ssize_t written = 0;
+            while (written < bytes)
+            {
+                ssize_t result = write(output, buffer + written, bytes - written);
+                if (result == -1 && errno != EINTR)
+                {
+                    copied = false;
+                    break;
+                }
+                written += result == -1 ? 0 : result;
+            }
+            if (!copied)
+            {
+                break;
+            }
+        }
+    }
+    close(input);
+    close(output);
+    if (!copied)
+    {
+        unlink(to.c_str());
+    }
+    return copied;
+}
+
+string cacheEntryPath(uint64_t cacheKey)
+{
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(cacheKey));
+    return cacheDirectory + "/" + string(name, 2) + "/" + name;
+}
+
+bool computeCacheKey(const string &target, const vector<string> &prerequisites, uint64_t commandHash, uint64_t &cacheKey)
+{
+    string key = target + "\n" + to_string(commandHash) + "\n";
+    for (const string &prerequisite : prerequisites)
+    {
+        uint64_t hash;
+        if (!hashFile(prerequisite, hash))
+        {
+            return false;
+        }
+        key += prerequisite + ":" + to_string(hash) + "\n";
+    }
+    unordered_map<string, BuildRecord>::const_iterator record = buildRecords.find(target);
+    if (record != buildRecords.end())
+    {
+        for (const string &dependency : record->second.dependencies)
+        {
+            uint64_t hash;
+            if (!hashFile(dependency, hash))
+            {
+                return false;
+            }
+            key += dependency + ":" + to_string(hash) + "\n";
+        }
+    }
+    cacheKey = xxHash64(reinterpret_cast<const unsigned char *>(key.data()), key.size());
+    return true;
+}
+
+// A cache entry may share its inode with the target, so the target is unlinked
+// before its commands run rather than being rewritten in place.
+void detachCachedTarget(const string &target)
+{
+    struct stat fileStat;
+    if (stat(target.c_str(), &fileStat) == 0 && fileStat.st_nlink > 1)
+    {
+        unlink(target.c_str());
+    }
+}
+
+// The cache key only covers headers that .mymake_db already knows about, so
+// each entry also lists the headers it was compiled against ("hash path" per
+// line in entry.deps). A restore is refused unless they all still match, or
+// when the list is missing: it is always put in place before the entry.
+bool cachedDependenciesMatch(const string &entry, const string &target)
+{
+    ifstream input((entry + ".deps").c_str());
+    if (!input)
+    {
+        return false;
+    }
+    vector<string> dependencies;
+    unsigned long long expected;
+    string path;
+    while (input >> expected && getline(input >> ws, path))
+    {
+        uint64_t hash;
+        if (!hashFile(path, hash) || hash != expected)
+        {
+            if (printDebugInfo)
+            {
+                printdebugInfoLine(target, "Cached entry was built against a different " + path, 0);
+            }
+            return false;
+        }
+        dependencies.push_back(path);
+    }
+    discoveredDependencies[target] = dependencies;
+    return true;
+}
+
+bool storeCachedDependencies(const string &entry, const string &target)
+{
+    string depsFile = entry + ".deps";
+    string tempFile = depsFile + ".tmp" + to_string(getpid());
+    ofstream output(tempFile.c_str());
+    unordered_map<string, BuildRecord>::const_iterator record = buildRecords.find(target);
+    if (record != buildRecords.end())
+    {
+        for (const string &dependency : record->second.dependencies)
+        {
+            uint64_t hash = 0;
+            hashFile(dependency, hash);
+            output << hash << " " << dependency << "\n";
+        }
+    }
+    output.close();
+    if (!output || rename(tempFile.c_str(), depsFile.c_str()) != 0)
+    {
+        unlink(tempFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool restoreCachedTarget(const string &target, const vector<string> &prerequisites, uint64_t commandHash, uint64_t &cacheKey)
+{
+    cacheKey = 0;
+    if (cacheDirectory.empty() || !computeCacheKey(target, prerequisites, commandHash, cacheKey))
+    {
+        return false;
+    }
+    string entry = cacheEntryPath(cacheKey);
+    bool restored = false;
+    if (access(entry.c_str(), F_OK) == 0 && cachedDependenciesMatch(entry, target))
+    {
+        unlink(target.c_str());
+        restored = link(entry.c_str(), target.c_str()) == 0 || copyFile(entry, target);
+    }
+    if (!restored)
+    {
+        cacheMisses++;
+        detachCachedTarget(target);
+        return false;
+    }
+    utimensat(AT_FDCWD, target.c_str(), nullptr, 0);
+    cacheHits++;
+    printdebugInfoLine("mymake", "Restored '" + target + "' from cache", 0);
+    recordBuild(target, prerequisites, commandHash);
+    return true;
+}
+
+void storeCachedTarget(const string &target, uint64_t cacheKey)
+{
+    if (cacheDirectory.empty() || cacheKey == 0 || !fileExists(target))
+    {
+        return;
+    }
+    string entry = cacheEntryPath(cacheKey);
+    string shard = entry.substr(0, entry.rfind('/'));
+    mkdir(cacheDirectory.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+    mkdir(shard.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+    // Both files are written under temporary names; the header list is
+    // renamed into place first, so a reader never finds an entry without it.
+    string tempFile = entry + ".tmp" + to_string(getpid());
+    unlink(tempFile.c_str());
+    if ((link(target.c_str(), tempFile.c_str()) == 0 || copyFile(target, tempFile)) &&
+        storeCachedDependencies(entry, target) && rename(tempFile.c_str(), entry.c_str()) == 0)
+    {
+        cacheStores++;
+        return;
+    }
+    unlink(tempFile.c_str());
+    if (printDebugInfo)
+    {
+        printdebugInfoLine(target, "Could not store target in cache " + cacheDirectory, 0);
+    }
+}
+
+void printCacheStatistics()
+{
+    if (cacheDirectory.empty() || cacheHits + cacheMisses == 0)
+    {
+        return;
+    }
+    printdebugInfoLine("mymake", "Cache: " + to_string(cacheHits) + " hits, " + to_string(cacheMisses) + " misses, " + to_string(cacheStores) + " stored", 0);
+}
+
+// MYPATH is read once and every directory in it is listed a single time;
+// the first directory holding a name wins, as with a per-command access() walk.
+void loadSearchIndex()
+{
+    searchIndexLoaded = true;
+    const char *myPathEnv = getenv("MYPATH");
+    if (myPathEnv == nullptr)
+    {
+        cerr << "Error: MYPATH environment variable is not set!" << endl;
+        return;
+    }
+    string myPath = myPathEnv;
+    size_t start = 0;
+    while (start <= myPath.size())
+    {
+        size_t end = myPath.find(':', start);
+        if (end == string::npos)
+        {
+            end = myPath.size();
+        }
+        string path = myPath.substr(start, end - start);
+        start = end + 1;
+        if (path.empty())
+        {
+            continue;
+        }
+        searchDirectories.push_back(path);
+        DIR *dir = opendir(path.c_str());
+        if (dir == nullptr)
+        {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                searchIndex.insert(make_pair(string(entry->d_name), path + '/' + entry->d_name));
+            }
+        }
+        closedir(dir);
+    }
+}
+
+// Names containing a '/' and files created after the scan fall back to
+// probing each directory; hits are remembered, misses are not.
+string resolveSearchPath(const string &name)
+{
+    if (!searchIndexLoaded)
+    {
+        loadSearchIndex();
+    }
+    unordered_map<string, string>::const_iterator found = searchIndex.find(name);
+    if (found != searchIndex.end())
+    {
+        return found->second;
+    }
+    for (const string &path : searchDirectories)
+    {
+        string fullPath = path + '/' + name;
+        if (fileExists(fullPath))
+        {
+            searchIndex.insert(make_pair(name, fullPath));
+            return fullPath;
+        }
+    }
+    return "";
+}
+
+char *searchCommand(const string &command)
+{
+    string commandPath = command;
+    if (command.front() != '/')
+    {
+        string resolved = resolveSearchPath(command);
+        if (!resolved.empty())
+        {
+            commandPath = resolved;
+        }
+    }
+    char *result = new char[commandPath.size() + 1];
+    strcpy(result, commandPath.c_str());
+    return result;
+}
+
+string searchFile(const string &filename)
+{
+    if (filename[0] == '/')
+    {
+        return filename;
+    }
+    string resolved = resolveSearchPath(filename);
+    return resolved.empty() ? filename : resolved;
+}
+
+void terminateChildProcesses(vector<pid_t> childProcesses)
+{
+    for (pid_t childPid : childProcesses)
+    {
+        if (printDebugInfo)
+        {
+            printdebugInfoLine("mymake", "Killing child PID: " + to_string(childPid), 0);
+        }
+        kill(childPid, SIGKILL);
+    }
+}
+
+// GNU make jobserver. A make started with -jN hands N-1 tokens (bytes) to a
+// pipe or fifo named in MAKEFLAGS; each job beyond the first one reads a token
+// and writes it back when done, so nested builds share a single -j N.
+//
+// Drops the -j and jobserver words from MAKEFLAGS, keeping everything else.
+string stripJobserverFlags(const string &flags, string &auth, int &jobs)
+{
+    istringstream words(flags);
+    string word;
+    string kept;
+    while (words >> word)
+    {
+        if (word.compare(0, 17, "--jobserver-auth=") == 0 || word.compare(0, 16, "--jobserver-fds=") == 0)
+        {
+            auth = word.substr(word.find('=') + 1);
+        }
+        else if (word.compare(0, 2, "-j") == 0 && word.find_first_not_of("0123456789", 2) == string::npos)
+        {
+            jobs = atoi(word.c_str() + 2);
+        }
+        else
+        {
+            kept += (kept.empty() ? "" : " ") + word;
+        }
+    }
+    return kept;
+}
+
+// Reads through a file description of our own, so that making it
+// nonblocking does not affect the other processes sharing the pipe.
+int openJobTokenFd(int fd)
+{
+    string path = "/proc/self/fd/" + to_string(fd);
+    return open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+bool connectJobserver(const string &auth)
+{
+    if (auth.compare(0, 5, "fifo:") == 0)
+    {
+        jobTokenReadFd = open(auth.c_str() + 5, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        jobTokenWriteFd = jobTokenReadFd;
+        return jobTokenReadFd != -1;
+    }
+    int readFd = -1;
+    int writeFd = -1;
+    if (sscanf(auth.c_str(), "%d,%d", &readFd, &writeFd) != 2 || fcntl(readFd, F_GETFD) == -1 || fcntl(writeFd, F_GETFD) == -1)
+    {
+        return false;
+    }
+    jobTokenReadFd = openJobTokenFd(readFd);
+    jobTokenWriteFd = writeFd;
+    return jobTokenReadFd != -1;
+}
+
+bool createJobserver(string &auth)
+{
+    if (jobserverStyle == "fifo")
+    {
+        // The fifo lives in a directory of its own, so that nobody can put
+        // something else at a predictable name before we create it.
+        const char *temporary = getenv("TMPDIR");
+        string directory = string(temporary != nullptr ? temporary : "/tmp") + "/mymake-jobserver-XXXXXX";
+        if (mkdtemp(&directory[0]) == nullptr)
+        {
+            return false;
+        }
+        jobserverFifo = directory + "/fifo";
+        if (mkfifo(jobserverFifo.c_str(), S_IRUSR | S_IWUSR) == -1)
+        {
+            rmdir(directory.c_str());
+            jobserverFifo = "";
+            return false;
+        }
+        auth = "fifo:" + jobserverFifo;
+        jobTokenReadFd = open(jobserverFifo.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        jobTokenWriteFd = jobTokenReadFd;
+    }
+    else
+    {
+        // Both ends stay open across exec so that sub-makes inherit them.
+        if (pipe(jobserverPipe) == -1)
+        {
+            return false;
+        }
+        auth = to_string(jobserverPipe[0]) + "," + to_string(jobserverPipe[1]);
+        jobTokenReadFd = openJobTokenFd(jobserverPipe[0]);
+        jobTokenWriteFd = jobserverPipe[1];
+    }
+    if (jobTokenReadFd == -1)
+    {
+        return false;
+    }
+    string tokens(maxJobs - 1, '+');
+    return write(jobTokenWriteFd, tokens.data(), tokens.size()) == static_cast<ssize_t>(tokens.size());
+}
+
+// Tops the tokens we hold up to count. Returns false when the pool is empty.
+bool acquireJobTokens(size_t count)
+{
+    while (jobTokenReadFd != -1 && jobTokens.size() < count)
+    {
+        char token;
+        if (read(jobTokenReadFd, &token, 1) != 1)
+        {
+            return false;
+        }
+        jobTokens.push_back(token);
+    }
+    return true;
+}
+
+void releaseJobTokens(size_t count)
+{
+    while (jobTokens.size() > count)
+    {
+        if (write(jobTokenWriteFd, &jobTokens.back(), 1) == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        jobTokens.pop_back();
+    }
+}
+
+void stopJobserver()
+{
+    releaseJobTokens(0);
+    if (jobTokenReadFd != -1)
+    {
+        close(jobTokenReadFd);
+    }
+    if (!jobserverFifo.empty())
+    {
+        unlink(jobserverFifo.c_str());
+        rmdir(jobserverFifo.substr(0, jobserverFifo.rfind('/')).c_str());
+        jobserverFifo = "";
+    }
+    for (int &fd : jobserverPipe)
+    {
+        if (fd != -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    jobTokenReadFd = -1;
+    jobTokenWriteFd = -1;
+    if (makeflagsSaved && savedMakeflags.empty())
+    {
+        unsetenv("MAKEFLAGS");
+    }
+    else if (makeflagsSaved)
+    {
+        setenv("MAKEFLAGS", savedMakeflags.c_str(), 1);
+    }
+}
+
+// Joins the jobserver named in MAKEFLAGS unless -j was given on the command
+// line; otherwise a -j N build becomes the jobserver for its commands.
+void startJobserver()
+{
+    if (jobTokenReadFd != -1)
+    {
+        return;
+    }
+    if (!makeflagsSaved)
+    {
+        const char *flags = getenv("MAKEFLAGS");
+        savedMakeflags = flags != nullptr ? flags : "";
+        makeflagsSaved = true;
+    }
+    string auth;
+    int jobs = 0;
+    string flags = stripJobserverFlags(savedMakeflags, auth, jobs);
+    if (!auth.empty() && !jobsGiven)
+    {
+        if (connectJobserver(auth))
+        {
+            maxJobs = jobs > 0 ? jobs : max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+            return;
+        }
+        printdebugInfoLine("mymake", "Jobserver " + auth + " is not available, using -j 1", 0);
+        maxJobs = 1;
+    }
+    if (maxJobs > 1)
+    {
+        if (!createJobserver(auth))
+        {
+            perror("Error creating jobserver");
+            stopJobserver();
+            return;
+        }
+        // Like GNU make, keep the single-letter flags ("ks") as the first
+        // word, where sub-makes look for them, and add our words after it.
+        string letters = "";
+        if (!flags.empty() && flags[0] != '-' && flags.substr(0, flags.find(' ')).find('=') == string::npos)
+        {
+            letters = flags.substr(0, flags.find(' '));
+            flags = flags.size() > letters.size() ? flags.substr(letters.size() + 1) : "";
+        }
+        flags = letters + " -j" + to_string(maxJobs) + " --jobserver-auth=" + auth + (flags.empty() ? "" : " " + flags);
+    }
+    else if (auth.empty())
+    {
+        return;
+    }
+    setenv("MAKEFLAGS", flags.c_str(), 1);
+}
+
+void terminateProcess(int parentId)
+{
+    if (printDebugInfo)
+    {
+        printdebugInfoLine("mymake", "Parent ID: " + to_string(parentId), 0);
+        printdebugInfoLine("mymake", "Child PIDs: " + to_string(childProcesses.size()), 0);
+    }
+    terminateChildProcesses(childProcesses);
+    stopJobserver();
+    kill(parentId, SIGTERM);
+}
+
+vector<string> splitCommands(const string &command)
+{
+    vector<string> commands;
+    istringstream iss(command);
+    string singleCommand;
+
+    while (getline(iss, singleCommand, ';'))
+    {
+        // Remove leading and trailing whitespaces
+        singleCommand.erase(0, singleCommand.find_first_not_of(" \t"));
+        singleCommand.erase(singleCommand.find_last_not_of(" \t") + 1);
+
+        if (!singleCommand.empty())
+        {
+            commands.push_back(singleCommand);
+        }
+    }
+
+    return commands;
+}
+vector<string> splitPipeCommands(const string &command)
+{
+    string commandCopy = command;
+    vector<string> commands;
+    size_t pos = 0;
+
+    while ((pos = commandCopy.find('|')) != string::npos)
+    {
+        commands.push_back(commandCopy.substr(0, pos));
+        commandCopy.erase(0, pos + 1);
+    }
+
+    if (!commandCopy.empty())
+    {
+        commands.push_back(commandCopy);
+    }
+    return commands;
+}
+
+void handleSigInt(int signo)
+{
+    printdebugInfoLine("mymake", "Interrupt", 0);
+    if (printDebugInfo)
+    {
+        printdebugInfoLine(target, "Received SIGINT signal.", 0);
+    }
+    int parentId = getpid();
+    terminateProcess(parentId);
+}
+
+void handleTimeout(int signo)
+{
+    printdebugInfoLine("mymake", "Timeout Reached", 0);
+    timeoutFlag = true;
+    handleSigInt(SIGINT);
+}
+
+void freeCommandArgs(vector<char *> &cmdArgs)
+{
+    for (char *arg : cmdArgs)
+    {
+        delete[] arg;
+    }
+    cmdArgs.clear();
+}
+
+void forgetChildProcess(pid_t childPid)
+{
+    for (size_t i = 0; i < childProcesses.size(); ++i)
+    {
+        if (childProcesses[i] == childPid)
+        {
+            childProcesses[i] = childProcesses.back();
+            childProcesses.pop_back();
+            return;
+        }
+    }
+}
+
+void failStage(Pipeline &pipeline, bool lastStage, int exitStatus)
+{
+    if ((lastStage || pipeFail) && pipeline.exitStatus == 0)
+    {
+        pipeline.exitStatus = exitStatus;
+    }
+}
+
+bool changeDirectory(const vector<char *> &cmdArgs, string &workingDirectory)
+{
+    if (cmdArgs.size() != 3)
+    {
+        cerr << "Error: 'cd' command requires one argument (directory)." << endl;
+        return true;
+    }
+    string directory = cmdArgs[1];
+    if (directory[0] != '/' && !workingDirectory.empty())
+    {
+        directory = workingDirectory + "/" + directory;
+    }
+    struct stat dirStat;
+    if (stat(directory.c_str(), &dirStat) == -1)
+    {
+        perror("Error changing directory");
+        return false;
+    }
+    if (!S_ISDIR(dirStat.st_mode))
+    {
+        errno = ENOTDIR;
+        perror("Error changing directory");
+        return false;
+    }
+    workingDirectory = directory;
+    return true;
+}
+
+long long traceClock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - traceStart.tv_sec) * 1000000LL + (now.tv_nsec - traceStart.tv_nsec) / 1000;
+}
+
+double timevalMilliseconds(const struct timeval &value)
+{
+    return value.tv_sec * 1000.0 + value.tv_usec / 1000.0;
+}
+
+void traceCommandStarted(pid_t pid, const string &command)
+{
+    if (traceFile.empty())
+    {
+        return;
+    }
+    TraceEvent &event = tracedCommands[pid];
+    event.name = command;
+    event.category = "command";
+    event.start = traceClock();
+}
+
+// Command usage is added to the owning target, which is open from
+// traceTargetStarted until traceTargetFinished.
+void traceCommandFinished(pid_t pid, const struct rusage &usage, const string &target, int slot)
+{
+    unordered_map<pid_t, TraceEvent>::iterator found = tracedCommands.find(pid);
+    if (found == tracedCommands.end())
+    {
+        return;
+    }
+    TraceEvent event = found->second;
+    tracedCommands.erase(found);
+    event.target = target;
+    event.duration = traceClock() - event.start;
+    event.slot = slot;
+    event.userMilliseconds = timevalMilliseconds(usage.ru_utime);
+    event.systemMilliseconds = timevalMilliseconds(usage.ru_stime);
+    event.maxResidentKilobytes = usage.ru_maxrss;
+    traceEvents.push_back(event);
+
+    unordered_map<string, TraceEvent>::iterator owner = tracedTargets.find(target);
+    if (owner != tracedTargets.end())
+    {
+        owner->second.userMilliseconds += event.userMilliseconds;
+        owner->second.systemMilliseconds += event.systemMilliseconds;
+        owner->second.maxResidentKilobytes = max(owner->second.maxResidentKilobytes, event.maxResidentKilobytes);
+    }
+}
+
+void traceTargetStarted(const string &target, int slot)
+{
+    if (traceFile.empty())
+    {
+        return;
+    }
+    TraceEvent &event = tracedTargets[target];
+    event.name = target;
+    event.category = "target";
+    event.target = target;
+    event.start = traceClock();
+    event.slot = slot;
+    event.userMilliseconds = 0;
+    event.systemMilliseconds = 0;
+    event.maxResidentKilobytes = 0;
+}
+
+void traceTargetFinished(const string &target)
+{
+    unordered_map<string, TraceEvent>::iterator found = tracedTargets.find(target);
+    if (found == tracedTargets.end())
+    {
+        return;
+    }
+    found->second.duration = traceClock() - found->second.start;
+    traceEvents.push_back(found->second);
+    tracedTargets.erase(found);
+}
+
+string jsonEscape(const string &text)
+{
+    string result;
+    for (char ch : text)
+    {
+        if (ch == '"' || ch == '\\')
+        {
+            result += '\\';
+            result += ch;
+        }
+        else if (static_cast<unsigned char>(ch) < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+            result += escaped;
+        }
+        else
+        {
+            result += ch;
+        }
+    }
+    return result;
+}
+
+// Writes the Chrome trace-event JSON; each job slot is shown as a thread.
+void writeTrace()
+{
+    if (traceFile.empty())
+    {
+        return;
+    }
+    ofstream output(traceFile.c_str());
+    if (!output)
+    {
+        perror("Error writing trace file");
+        return;
+    }
+    output << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    for (int slot = 0; slot < maxJobs; ++slot)
+    {
+        output << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << slot
+               << ",\"args\":{\"name\":\"job slot " << slot << "\"}},\n";
+    }
+    for (size_t i = 0; i < traceEvents.size(); ++i)
+    {
+        const TraceEvent &event = traceEvents[i];
+        output << "{\"name\":\"" << jsonEscape(event.name) << "\",\"cat\":\"" << event.category
+               << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.slot << ",\"ts\":" << event.start << ",\"dur\":" << event.duration
+               << ",\"args\":{\"target\":\"" << jsonEscape(event.target) << "\",\"user_ms\":" << event.userMilliseconds
+               << ",\"sys_ms\":" << event.systemMilliseconds << ",\"max_rss_kb\":" << event.maxResidentKilobytes << "}}"
+               << (i + 1 < traceEvents.size() ? ",\n" : "\n");
+    }
+    output << "]}\n";
+}
+
+bool capturingOutput()
+{
+    return outputSync != "none" || !logDirectory.empty();
+}
+
+void handleChildExit(int signo)
+{
+    int savedErrno = errno;
+    if (write(childExitPipe[1], "", 1) == -1)
+    {
+        // The pipe is full, so a wakeup is already pending.
+    }
+    errno = savedErrno;
+}
+
+// One epoll set watches every job's output pipes plus a self-pipe that the
+// SIGCHLD handler writes to, so the parent sleeps until either has news.
+// It is also used to wait for a jobserver token.
+bool setupEventLoop()
+{
+    if (outputEpollFd != -1)
+    {
+        return true;
+    }
+    outputEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (outputEpollFd == -1 || pipe2(childExitPipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+        perror("Error setting up event loop");
+        return false;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(outputEpollFd, EPOLL_CTL_ADD, childExitPipe[0], &event);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleChildExit;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, nullptr);
+    return true;
+}
+
+void writeAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+// Passes buffered output on to the terminal: everything without sync, whole
+// lines with --output-sync line, and nothing before the target finishes with
+// --output-sync target (unless complete is set).
+void emitOutput(OutputStream &stream, bool complete)
+{
+    size_t length = stream.buffer.size();
+    if (!complete && outputSync == "target")
+    {
+        return;
+    }
+    if (!complete && outputSync == "line")
+    {
+        size_t newline = stream.buffer.rfind('\n');
+        length = newline == string::npos ? 0 : newline + 1;
+    }
+    if (length == 0)
+    {
+        return;
+    }
+    cout.flush();
+    writeAll(stream.destination, stream.buffer.data(), length);
+    stream.buffer.erase(0, length);
+}
+
+void appendOutput(OutputCapture &capture, OutputStream &stream, const char *data, size_t length)
+{
+    if (capture.logFd != -1)
+    {
+        writeAll(capture.logFd, data, length);
+    }
+    stream.buffer.append(data, length);
+    emitOutput(stream, false);
+}
+
+void closeOutputStream(OutputStream &stream)
+{
+    epoll_ctl(outputEpollFd, EPOLL_CTL_DEL, stream.readFd, nullptr);
+    close(stream.readFd);
+    stream.readFd = -1;
+}
+
+// Reads whatever is waiting on a stream without blocking.
+void drainOutputStream(OutputCapture &capture, OutputStream &stream)
+{
+    char chunk[65536];
+    while (stream.readFd != -1)
+    {
+        ssize_t received = read(stream.readFd, chunk, sizeof(chunk));
+        if (received > 0)
+        {
+            appendOutput(capture, stream, chunk, received);
+        }
+        else if (received == 0)
+        {
+            closeOutputStream(stream);
+        }
+        else if (errno != EINTR)
+        {
+            return;
+        }
+    }
+}
+
+string logFileName(const string &target)
+{
+    string name = target;
+    replace(name.begin(), name.end(), '/', '_');
+    return logDirectory + "/" + name + ".log";
+}
+
+void beginCapture(OutputCapture &capture, const string &target)
+{
+    capture.active = false;
+    capture.logFd = -1;
+    if (!capturingOutput() || !setupEventLoop())
+    {
+        return;
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        OutputStream &stream = capture.streams[i];
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1)
+        {
+            perror("Error creating output pipe");
+            if (i == 1)
+            {
+                closeOutputStream(capture.streams[0]);
+                close(capture.streams[0].writeFd);
+            }
+            return;
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        stream.readFd = fds[0];
+        stream.writeFd = fds[1];
+        stream.destination = i == 0 ? STDOUT_FILENO : STDERR_FILENO;
+        stream.buffer.clear();
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &capture;
+        epoll_ctl(outputEpollFd, EPOLL_CTL_ADD, stream.readFd, &event);
+    }
+    if (!logDirectory.empty())
+    {
+        mkdir(logDirectory.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+        capture.logFd = open(logFileName(target).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (capture.logFd == -1)
+        {
+            perror("Error opening log file");
+        }
+    }
+    capture.active = true;
+}
+
+void flushCapture(OutputCapture &capture)
+{
+    if (!capture.active)
+    {
+        return;
+    }
+    cout.flush();
+    for (OutputStream &stream : capture.streams)
+    {
+        drainOutputStream(capture, stream);
+        emitOutput(stream, true);
+    }
+}
+
+// Called once every command of the target has exited: with the write ends
+// closed the pipes hold the rest of the output, which goes out in one block.
+void endCapture(OutputCapture &capture)
+{
+    if (!capture.active)
+    {
+        return;
+    }
+    for (OutputStream &stream : capture.streams)
+    {
+        close(stream.writeFd);
+    }
+    flushCapture(capture);
+    for (OutputStream &stream : capture.streams)
+    {
+        if (stream.readFd != -1)
+        {
+            closeOutputStream(stream);
+        }
+    }
+    if (capture.logFd != -1)
+    {
+        close(capture.logFd);
+    }
+    capture.active = false;
+}
+
+// Drains whatever the epoll set reports. Returns true when wakeFd fired.
+bool serviceEvents(int timeoutMilliseconds)
+{
+    struct epoll_event events[64];
+    int count = epoll_wait(outputEpollFd, events, 64, timeoutMilliseconds);
+    bool woken = false;
+    for (int i = 0; i < count; ++i)
+    {
+        if (events[i].data.ptr == &jobTokens)
+        {
+            woken = true;
+            continue;
+        }
+        OutputCapture *capture = static_cast<OutputCapture *>(events[i].data.ptr);
+        if (capture == nullptr)
+        {
+            char wakeups[64];
+            while (read(childExitPipe[0], wakeups, sizeof(wakeups)) > 0)
+            {
+            }
+            continue;
+        }
+        for (OutputStream &stream : capture->streams)
+        {
+            drainOutputStream(*capture, stream);
+        }
+    }
+    return woken;
+}
+
+// Waits for a child to exit while keeping every job's output pipes drained,
+// so a job that prints a lot never blocks on a full pipe. A negative timeout
+// waits indefinitely, otherwise 0 is returned once it has passed. 0 is also
+// returned as soon as wakeFd (a jobserver pipe, or -1) becomes readable.
+pid_t waitForChild(int &status, struct rusage &usage, int timeoutMilliseconds, int wakeFd)
+{
+    if (outputEpollFd == -1 && (wakeFd == -1 || !setupEventLoop()))
+    {
+        pid_t childPid = wait4(-1, &status, timeoutMilliseconds < 0 ? 0 : WNOHANG, &usage);
+        if (childPid == 0)
+        {
+            struct timespec pause = {timeoutMilliseconds / 1000, (timeoutMilliseconds % 1000) * 1000000L};
+            nanosleep(&pause, nullptr);
+        }
+        return childPid;
+    }
+    if (wakeFd != -1)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &jobTokens;
+        epoll_ctl(outputEpollFd, EPOLL_CTL_ADD, wakeFd, &event);
+    }
+    long long deadline = traceClock() + timeoutMilliseconds * 1000LL;
+    pid_t childPid;
+    while ((childPid = wait4(-1, &status, WNOHANG, &usage)) == 0)
+    {
+        int wait = -1;
+        if (timeoutMilliseconds >= 0)
+        {
+            long long remaining = deadline - traceClock();
+            if (remaining <= 0)
+            {
+                break;
+            }
+            wait = static_cast<int>((remaining + 999) / 1000);
+        }
+        if (serviceEvents(wait))
+        {
+            break;
+        }
+    }
+    if (wakeFd != -1)
+    {
+        epoll_ctl(outputEpollFd, EPOLL_CTL_DEL, wakeFd, nullptr);
+    }
+    return childPid;
+}
+
+// Spawns every stage of one '|' pipeline without waiting for any of them.
+// Redirections, pipe wiring and a preceding 'cd' are applied as posix_spawn
+// file actions, so mymake itself is never forked.
+void startPipeline(const string &pipelineText, string &workingDirectory, Pipeline &pipeline)
+{
+    pipeline.stagePids.clear();
+    pipeline.runningStages = 0;
+    pipeline.exitStatus = 0;
+    pipeline.killedBy = 0;
+    // The previous pipeline has exited, but its output may still sit in the
+    // pipes; take it first so that it stays above this pipeline's echo.
+    if (pipeline.capture != nullptr && pipeline.capture->active)
+    {
+        for (OutputStream &stream : pipeline.capture->streams)
+        {
+            drainOutputStream(*pipeline.capture, stream);
+        }
+    }
+
+    vector<string> commands = splitPipeCommands(pipelineText);
+    int input = -1;
+    for (int i = 0; i < static_cast<int>(commands.size()); ++i)
+    {
+        bool lastStage = i == static_cast<int>(commands.size()) - 1;
+        string inputFile = "";
+        string outputFile = "";
+        size_t inputRedirectionPos = commands[i].find('<');
+        if (inputRedirectionPos != string::npos)
+        {
+            inputFile = commands[i].substr(inputRedirectionPos + 1);
+            commands[i] = commands[i].substr(0, inputRedirectionPos);
+            inputFile = removeLeadingTrailingSpaces(inputFile);
+        }
+
+        size_t outputRedirectionPos = commands[i].find('>');
+        if (outputRedirectionPos != string::npos)
+        {
+            outputFile = commands[i].substr(outputRedirectionPos + 1);
+            outputFile = removeLeadingTrailingSpaces(outputFile);
+            commands[i] = commands[i].substr(0, outputRedirectionPos);
+        }
+        bool changeDir = false;
+        if (commands[i][0] == 'c' && commands[i][1] == 'd')
+        {
+            changeDir = true;
+        }
+        vector<char *> cmdArgs = buildCommandArgs(commands[i]);
+        if (cmdArgs[0] == nullptr)
+        {
+            freeCommandArgs(cmdArgs);
+            continue;
+        }
+        char *commandPath = searchCommand(cmdArgs[0]);
+        delete[] cmdArgs[0];
+        cmdArgs[0] = commandPath;
+        if (pipeline.capture != nullptr && pipeline.capture->active)
+        {
+            ostringstream line;
+            printCommand(cmdArgs, line);
+            appendOutput(*pipeline.capture, pipeline.capture->streams[0], line.str().data(), line.str().size());
+        }
+        else
+        {
+            printCommand(cmdArgs, cout);
+            cout.flush();
+        }
+        if (changeDir)
+        {
+            if (!changeDirectory(cmdArgs, workingDirectory))
+            {
+                failStage(pipeline, lastStage, EXIT_FAILURE);
+            }
+            freeCommandArgs(cmdArgs);
+            continue;
+        }
+
+        int pipefd[2] = {-1, -1};
+        if (!lastStage && pipe(pipefd) == -1)
+        {
+            perror("Error creating pipe");
+            freeCommandArgs(cmdArgs);
+            failStage(pipeline, true, EXIT_FAILURE);
+            break;
+        }
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (!workingDirectory.empty())
+        {
+            posix_spawn_file_actions_addchdir_np(&actions, workingDirectory.c_str());
+        }
+        if (input != -1)
+        {
+            posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+            posix_spawn_file_actions_addclose(&actions, input);
+        }
+        if (!inputFile.empty())
+        {
+            posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, inputFile.c_str(), O_RDONLY, 0);
+        }
+        if (!outputFile.empty())
+        {
+            posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        }
+        else if (!lastStage)
+        {
+            posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+        }
+        else if (pipeline.capture != nullptr && pipeline.capture->active)
+        {
+            posix_spawn_file_actions_adddup2(&actions, pipeline.capture->streams[0].writeFd, STDOUT_FILENO);
+        }
+        if (pipeline.capture != nullptr && pipeline.capture->active)
+        {
+            posix_spawn_file_actions_adddup2(&actions, pipeline.capture->streams[1].writeFd, STDERR_FILENO);
+        }
+        if (!lastStage)
+        {
+            posix_spawn_file_actions_addclose(&actions, pipefd[0]);
+            posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+        }
+
+        pid_t childPid;
+        int error = posix_spawn(&childPid, cmdArgs[0], &actions, nullptr, cmdArgs.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        freeCommandArgs(cmdArgs);
+
+        if (input != -1)
+        {
+            close(input);
+            input = -1;
+        }
+        if (!lastStage)
+        {
+            input = pipefd[0];
+            close(pipefd[1]);
+        }
+        if (error != 0)
+        {
+            errno = error;
+            perror("Error executing command");
+            failStage(pipeline, lastStage, EXIT_FAILURE);
+            continue;
+        }
+        childProcesses.push_back(childPid);
+        traceCommandStarted(childPid, commands[i]);
+        pipeline.stagePids.push_back(childPid);
+        pipeline.runningStages++;
+    }
+    if (input != -1)
+    {
+        close(input);
+    }
+}
+
+bool reapStage(Pipeline &pipeline, pid_t childPid, int status)
+{
+    for (size_t i = 0; i < pipeline.stagePids.size(); ++i)
+    {
+        if (pipeline.stagePids[i] == childPid)
+        {
+            forgetChildProcess(childPid);
+            pipeline.runningStages--;
+            if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+            {
+                failStage(pipeline, i == pipeline.stagePids.size() - 1, WEXITSTATUS(status));
+            }
+            else if (WIFSIGNALED(status) && (i == pipeline.stagePids.size() - 1 || pipeFail || WTERMSIG(status) != SIGPIPE))
+            {
+                // A killed stage (SIGKILL, the OOM killer, a crash) may have
+                // left a truncated output behind, so it fails the pipeline
+                // wherever it sits; only an early stage's SIGPIPE is normal.
+                printdebugInfoLine("mymake", "** Killed by signal " + to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")", 0);
+                failStage(pipeline, true, 128 + WTERMSIG(status));
+                pipeline.killedBy = WTERMSIG(status);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// As in GNU make, the target of a killed command is deleted: whatever the
+// command left behind is likely truncated, yet newer than its inputs.
+void deleteKilledTarget(const string &target)
+{
+    if (unlink(target.c_str()) == 0)
+    {
+        printdebugInfoLine("mymake", "Deleting file '" + target + "'", 0);
+    }
+    forgetFileState(target);
+}
+
+bool checkCommandStatus(int exitStatus)
+{
+    if (exitStatus != 0)
+    {
+        buildFailed = true;
+        if (continueOnError)
+        {
+            printdebugInfoLine("mymake", "** Error code: " + to_string(exitStatus) + ", Continue", 0);
+        }
+        else
+        {
+            printdebugInfoLine("mymake", "** Error code: " + to_string(exitStatus) + ", Terminate", 0);
+            saveBuildDatabase();
+            writeTrace();
+            terminateProcess(getpid());
+        }
+        return false;
+    }
+    return true;
+}
+
+// Runs the ';' separated pipelines of an expanded command line in turn.
+// Returns the status of the first one that fails, or -1 if waiting failed.
+int runCommandLine(const string &commandLine, OutputCapture &capture, const string &target)
+{
+    string workingDirectory = "";
+    for (const string &pipelineText : splitCommands(commandLine))
+    {
+        Pipeline pipeline;
+        pipeline.capture = &capture;
+        startPipeline(pipelineText, workingDirectory, pipeline);
+        while (pipeline.runningStages > 0)
+        {
+            int status;
+            struct rusage usage;
+            pid_t childPid = waitForChild(status, usage, -1, -1);
+            if (childPid == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                perror("Error waiting for pipeline");
+                return -1;
+            }
+            traceCommandFinished(childPid, usage, target, 0);
+            reapStage(pipeline, childPid, status);
+        }
+        if (pipeline.killedBy != 0)
+        {
+            deleteKilledTarget(target);
+        }
+        if (pipeline.exitStatus != 0)
+        {
+            return pipeline.exitStatus;
+        }
+    }
+    return 0;
+}
+
+bool executeCommand(const string &command, const AutomaticVariables &automatic, OutputCapture &capture)
+{
+    int status = runCommandLine(expandCommand(command, automatic), capture, automatic.target);
+    if (status == -1)
+    {
+        return false;
+    }
+    if (status != 0)
+    {
+        flushCapture(capture);
+        return checkCommandStatus(status);
+    }
+    return true;
+}
+
+// Remote execution. A worker (--worker) accepts one job per TCP connection:
+// the target, its input files and its expanded command lines. It runs them in
+// a scratch directory and sends back the output, every file the commands
+// created and the exit status. Frames are a type byte, a 32-bit length in
+// network order and the payload.
+bool sendAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+bool receiveAll(int fd, char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t received = recv(fd, data, length, 0);
+        if (received == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return false;
+        }
+        data += received;
+        length -= received;
+    }
+    return true;
+}
+
+bool sendFrame(int fd, char type, const string &payload)
+{
+    char header[5];
+    uint32_t length = htonl(static_cast<uint32_t>(payload.size()));
+    header[0] = type;
+    memcpy(header + 1, &length, sizeof(length));
+    return sendAll(fd, header, sizeof(header)) && sendAll(fd, payload.data(), payload.size());
+}
+
+bool receiveFrame(int fd, char &type, string &payload)
+{
+    char header[5];
+    if (!receiveAll(fd, header, sizeof(header)))
+    {
+        return false;
+    }
+    uint32_t length;
+    memcpy(&length, header + 1, sizeof(length));
+    type = header[0];
+    payload.resize(ntohl(length));
+    return payload.empty() || receiveAll(fd, &payload[0], payload.size());
+}
+
+bool readWholeFile(const string &path, string &content, mode_t &mode)
+{
+    struct stat info;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &info) == -1 || !S_ISREG(info.st_mode))
+    {
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    content.resize(info.st_size);
+    size_t done = 0;
+    while (done < content.size())
+    {
+        ssize_t received = read(fd, &content[done], content.size() - done);
+        if (received <= 0)
+        {
+            break;
+        }
+        done += received;
+    }
+    close(fd);
+    content.resize(done);
+    mode = info.st_mode & 07777;
+    return true;
+}
+
+// A file frame is "path\0mode\0content".
+string fileFrame(const string &path, const string &content, mode_t mode)
+{
+    return path + '\0' + to_string(mode) + '\0' + content;
+}
+
+// Paths a job may touch: relative, and not climbing out of its directory.
+bool isJobPath(const string &path)
+{
+    return !path.empty() && path[0] != '/' && path != ".." && path.compare(0, 3, "../") != 0 && path.find("/../") == string::npos;
+}
+
+void makeParentDirectories(const string &path)
+{
+    for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1))
+    {
+        mkdir(path.substr(0, slash).c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+    }
+}
+
+bool writeFileFrame(const string &directory, const string &payload, string &path)
+{
+    size_t pathEnd = payload.find('\0');
+    size_t modeEnd = pathEnd == string::npos ? string::npos : payload.find('\0', pathEnd + 1);
+    if (modeEnd == string::npos)
+    {
+        return false;
+    }
+    path = payload.substr(0, pathEnd);
+    if (!isJobPath(path))
+    {
+        return false;
+    }
+    string fullPath = directory.empty() ? path : directory + "/" + path;
+    makeParentDirectories(fullPath);
+    mode_t mode = static_cast<mode_t>(atoi(payload.c_str() + pathEnd + 1)) & 0777;
+    int fd = open(fullPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (fd == -1)
+    {
+        perror(("Error writing " + fullPath).c_str());
+        return false;
+    }
+    writeAll(fd, payload.data() + modeEnd + 1, payload.size() - modeEnd - 1);
+    fchmod(fd, mode);
+    close(fd);
+    return true;
+}
+
+// Splits "host:port" at the last colon; a bare port means the loopback.
+int connectToAddress(const string &address, bool listen)
+{
+    size_t colon = address.rfind(':');
+    string host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+    string port = colon == string::npos ? address : address.substr(colon + 1);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+    {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *candidate = addresses; candidate != nullptr && fd == -1; candidate = candidate->ai_next)
+    {
+        fd = socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        bool ready = listen ? bind(fd, candidate->ai_addr, candidate->ai_addrlen) == 0 && ::listen(fd, 64) == 0
+                            : connect(fd, candidate->ai_addr, candidate->ai_addrlen) == 0;
+        if (!ready)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+// Inputs are the target's prerequisites plus the headers its last build
+// read. Only relative paths are shipped; absolute ones (system headers,
+// toolchains) must already exist on the worker.
+vector<string> remoteInputs(const string &target, const vector<string> &prerequisites)
+{
+    vector<string> inputs;
+    set<string> seen;
+    vector<string> candidates = prerequisites;
+    unordered_map<string, vector<string>>::const_iterator discovered = discoveredDependencies.find(target);
+    if (discovered != discoveredDependencies.end())
+    {
+        candidates.insert(candidates.end(), discovered->second.begin(), discovered->second.end());
+    }
+    for (const string &path : candidates)
+    {
+        if (!path.empty() && path[0] != '/' && path.compare(0, 3, "../") != 0 && seen.insert(path).second)
+        {
+            inputs.push_back(path);
+        }
+    }
+    return inputs;
+}
+
+void relayOutput(OutputCapture *capture, int stream, const string &data)
+{
+    if (capture != nullptr && capture->active)
+    {
+        appendOutput(*capture, capture->streams[stream], data.data(), data.size());
+        return;
+    }
+    cout.flush();
+    writeAll(stream == 0 ? STDOUT_FILENO : STDERR_FILENO, data.data(), data.size());
+}
+
+// Sends one job over an open connection and applies the reply. Returns the
+// job's exit status, or -1 if the connection broke.
+int shipJob(int fd, const string &target, const vector<string> &inputs, const vector<string> &commandLines, OutputCapture *capture)
+{
+    bool sent = sendFrame(fd, 'T', target);
+    for (const string &input : inputs)
+    {
+        string content;
+        mode_t mode;
+        if (sent && readWholeFile(input, content, mode))
+        {
+            sent = sendFrame(fd, 'I', fileFrame(input, content, mode));
+        }
+    }
+    for (const string &commandLine : commandLines)
+    {
+        sent = sent && sendFrame(fd, 'C', commandLine);
+    }
+    if (!sent || !sendFrame(fd, 'R', ""))
+    {
+        return -1;
+    }
+    char type;
+    string payload;
+    while (receiveFrame(fd, type, payload))
+    {
+        if (type == 'O' || type == 'E')
+        {
+            relayOutput(capture, type == 'O' ? 0 : 1, payload);
+        }
+        else if (type == 'F')
+        {
+            string path;
+            writeFileFrame("", payload, path);
+        }
+        else if (type == 'S' && payload.size() == sizeof(uint32_t))
+        {
+            uint32_t status;
+            memcpy(&status, payload.data(), sizeof(status));
+            return ntohl(status);
+        }
+    }
+    return -1;
+}
+
+// Phony targets, those listed under .LOCAL and those without prerequisites
+// (clean, install and the like) act on this tree rather than produce an
+// output from their inputs, so they are never shipped to a worker.
+bool runsRemotely(const string &target, const vector<string> &prerequisites)
+{
+    return !remoteWorkers.empty() && !prerequisites.empty() && localTargets.count(target) == 0 && phonyTargets.count(target) == 0;
+}
+
+// Tries the workers in turn starting with firstWorker, and builds locally
+// only if none of them can be reached.
+int runRemoteTarget(const string &target, const vector<string> &prerequisites, const vector<string> &commandLines, size_t firstWorker, OutputCapture *capture)
+{
+    vector<string> inputs = remoteInputs(target, prerequisites);
+    for (size_t attempt = 0; attempt < remoteWorkers.size(); ++attempt)
+    {
+        const string &worker = remoteWorkers[(firstWorker + attempt) % remoteWorkers.size()];
+        int fd = connectToAddress(worker, false);
+        if (fd == -1)
+        {
+            printdebugInfoLine("mymake", "Worker " + worker + " is not reachable", 0);
+            continue;
+        }
+        int status = shipJob(fd, target, inputs, commandLines, capture);
+        close(fd);
+        if (status != -1)
+        {
+            return status;
+        }
+        printdebugInfoLine("mymake", "Lost worker " + worker + " while building '" + target + "'", 0);
+    }
+    printdebugInfoLine("mymake", "No worker available, building '" + target + "' locally", 0);
+    OutputCapture inactive;
+    inactive.active = false;
+    for (const string &commandLine : commandLines)
+    {
+        int status = runCommandLine(commandLine, capture != nullptr ? *capture : inactive, target);
+        if (status != 0)
+        {
+            return status == -1 ? EXIT_FAILURE : status;
+        }
+    }
+    return 0;
+}
+
+void listJobFiles(const string &directory, const string &relative, vector<string> &files)
+{
+    DIR *entries = opendir((relative.empty() ? directory : directory + "/" + relative).c_str());
+    if (entries == nullptr)
+    {
+        return;
+    }
+    while (struct dirent *entry = readdir(entries))
+    {
+        string name = entry->d_name;
+        if (name == "." || name == "..")
+        {
+            continue;
+        }
+        string path = relative.empty() ? name : relative + "/" + name;
+        struct stat info;
+        if (lstat((directory + "/" + path).c_str(), &info) == -1)
+        {
+            continue;
+        }
+        if (S_ISDIR(info.st_mode))
+        {
+            listJobFiles(directory, path, files);
+        }
+        else if (S_ISREG(info.st_mode))
+        {
+            files.push_back(path);
+        }
+    }
+    closedir(entries);
+}
+
+void removeTree(const string &path)
+{
+    struct stat info;
+    if (lstat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+    {
+        DIR *entries = opendir(path.c_str());
+        while (entries != nullptr)
+        {
+            struct dirent *entry = readdir(entries);
+            if (entry == nullptr)
+            {
+                closedir(entries);
+                break;
+            }
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            {
+                removeTree(path + "/" + entry->d_name);
+            }
+        }
+        rmdir(path.c_str());
+    }
+    else
+    {
+        unlink(path.c_str());
+    }
+}
+
+int scratchFile(const string &directory)
+{
+    string path = directory + "/mymake-output-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd != -1)
+    {
+        unlink(path.c_str());
+    }
+    return fd;
+}
+
+string readScratchFile(int fd)
+{
+    string content;
+    char chunk[65536];
+    ssize_t received;
+    lseek(fd, 0, SEEK_SET);
+    while ((received = read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        content.append(chunk, received);
+    }
+    close(fd);
+    return content;
+}
+
+// Runs in a child of the worker, one per connection.
+void serveJob(int fd)
+{
+    const char *temporary = getenv("TMPDIR");
+    string scratch = temporary != nullptr ? temporary : "/tmp";
+    string directory = scratch + "/mymake-job-XXXXXX";
+    if (mkdtemp(&directory[0]) == nullptr)
+    {
+        perror("Error creating job directory");
+        return;
+    }
+    string target;
+    vector<string> commandLines;
+    set<string> inputs;
+    char type;
+    string payload;
+    bool complete = false;
+    while (!complete && receiveFrame(fd, type, payload))
+    {
+        string path;
+        if (type == 'T')
+        {
+            target = payload;
+        }
+        else if (type == 'I' && writeFileFrame(directory, payload, path))
+        {
+            inputs.insert(path);
+        }
+        else if (type == 'C')
+        {
+            commandLines.push_back(payload);
+        }
+        complete = type == 'R';
+    }
+    if (complete)
+    {
+        // Recipes such as "cc -c src/a.c -o obj/a.o" expect the target's
+        // directory to exist, as it does in the client's tree.
+        if (isJobPath(target))
+        {
+            makeParentDirectories(directory + "/" + target);
+        }
+        printdebugInfoLine("mymake", "Building '" + target + "' in " + directory, 0);
+        int output = scratchFile(scratch);
+        int errors = scratchFile(scratch);
+        int status = output == -1 || errors == -1 || chdir(directory.c_str()) == -1 ? EXIT_FAILURE : 0;
+        if (status == 0)
+        {
+            dup2(output, STDOUT_FILENO);
+            dup2(errors, STDERR_FILENO);
+            OutputCapture inactive;
+            inactive.active = false;
+            for (size_t i = 0; i < commandLines.size() && status == 0; ++i)
+            {
+                status = runCommandLine(commandLines[i], inactive, target);
+                status = status == -1 ? EXIT_FAILURE : status;
+            }
+            cout.flush();
+        }
+        sendFrame(fd, 'O', output == -1 ? "" : readScratchFile(output));
+        sendFrame(fd, 'E', errors == -1 ? "" : readScratchFile(errors));
+        vector<string> files;
+        listJobFiles(directory, "", files);
+        for (size_t i = 0; i < files.size() && status == 0; ++i)
+        {
+            string content;
+            mode_t mode;
+            if (inputs.count(files[i]) == 0 && readWholeFile(directory + "/" + files[i], content, mode))
+            {
+                sendFrame(fd, 'F', fileFrame(files[i], content, mode));
+            }
+        }
+        uint32_t status32 = htonl(static_cast<uint32_t>(status));
+        sendFrame(fd, 'S', string(reinterpret_cast<const char *>(&status32), sizeof(status32)));
+    }
+    removeTree(directory);
+}
+
+// There is no authentication: anyone who can connect may run commands as
+// the worker's user, which is why a bare port binds to the loopback only.
+int runWorker()
+{
+    int listener = connectToAddress(workerAddress, true);
+    if (listener == -1)
+    {
+        cerr << "Error: Cannot listen on " << workerAddress << endl;
+        return 1;
+    }
+    printdebugInfoLine("mymake", "Worker listening on " + workerAddress, 0);
+    while (true)
+    {
+        int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        while (waitpid(-1, nullptr, WNOHANG) > 0)
+        {
+        }
+        if (client == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error accepting job");
+            return 1;
+        }
+        cout.flush();
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(listener);
+            serveJob(client);
+            cout.flush();
+            _exit(0);
+        }
+        if (pid == -1)
+        {
+            perror("Error forking job");
+        }
+        close(client);
+    }
+}
+
+// Turns an old-fashioned suffix rule (".c.o" or ".c") into the equivalent
+// pattern rule. Special targets such as .PHONY are left alone.
+bool suffixRuleToPattern(const Rule &rule, PatternRule &patternRule)
+{
+    const string &name = rule.target;
+    if (name.size() < 2 || name[0] != '.' || !rule.prerequisites.empty() || name.find_first_of("/%") != string::npos)
+    {
+        return false;
+    }
+    size_t dot = name.find('.', 1);
+    if (dot == string::npos)
+    {
+        for (char ch : name)
+        {
+            if (ch >= 'A' && ch <= 'Z')
+            {
+                return false;
+            }
+        }
+        patternRule.target = "%";
+        patternRule.prerequisites.push_back("%" + name);
+    }
+    else
+    {
+        if (dot + 1 == name.size() || name.find('.', dot + 1) != string::npos)
+        {
+            return false;
+        }
+        patternRule.target = "%" + name.substr(dot);
+        patternRule.prerequisites.push_back("%" + name.substr(0, dot));
+    }
+    patternRule.rule = &rule;
+    return true;
+}
+
+void processPatternRules()
+{
+    patternRules.clear();
+    for (const Rule &rule : rules)
+    {
+        if (rule.commands.empty())
+        {
+            continue;
+        }
+        PatternRule patternRule;
+        if (rule.target.find('%') != string::npos)
+        {
+            patternRule.target = rule.target;
+            patternRule.prerequisites = rule.prerequisites;
+            patternRule.rule = &rule;
+        }
+        else if (!suffixRuleToPattern(rule, patternRule))
+        {
+            continue;
+        }
+        patternRules.push_back(patternRule);
+    }
+}
+
+// Pattern rules are filed in a trie keyed on the text after the '%', read
+// backwards, so a target only visits the rules whose suffix it ends with.
+void indexRules()
+{
+    ruleIndex.clear();
+    ruleIndex.reserve(rules.size());
+    localTargets.clear();
+    phonyTargets.clear();
+    for (size_t i = 0; i < rules.size(); ++i)
+    {
+        ruleIndex.insert(make_pair(rules[i].target, i));
+        if (rules[i].target == ".PHONY")
+        {
+            phonyTargets.insert(rules[i].prerequisites.begin(), rules[i].prerequisites.end());
+        }
+        else if (rules[i].target == ".LOCAL")
+        {
+            localTargets.insert(rules[i].prerequisites.begin(), rules[i].prerequisites.end());
+        }
+    }
+    patternMatches.clear();
+    suffixTrie.assign(1, SuffixTrieNode());
+    for (size_t i = 0; i < patternRules.size(); ++i)
+    {
+        const string &pattern = patternRules[i].target;
+        size_t node = 0;
+        for (size_t j = pattern.size(); j > pattern.find('%') + 1; --j)
+        {
+            unordered_map<char, size_t>::const_iterator child = suffixTrie[node].children.find(pattern[j - 1]);
+            if (child != suffixTrie[node].children.end())
+            {
+                node = child->second;
+                continue;
+            }
+            size_t next = suffixTrie.size();
+            suffixTrie.push_back(SuffixTrieNode());
+            suffixTrie[node].children[pattern[j - 1]] = next;
+            node = next;
+        }
+        suffixTrie[node].patternRules.push_back(i);
+    }
+}
+
+const Rule *findRule(const string &target)
+{
+    unordered_map<string, size_t>::const_iterator found = ruleIndex.find(target);
+    if (found == ruleIndex.end())
+    {
+        return nullptr;
+    }
+    return &rules[found->second];
+}
+
+bool isSpecialTarget(const string &name)
+{
+    return name.find('%') != string::npos || (name.size() > 1 && name[0] == '.' && name.find('/') == string::npos);
+}
+
+string defaultTarget()
+{
+    for (const Rule &rule : rules)
+    {
+        if (!isSpecialTarget(rule.target))
+        {
+            return rule.target;
+        }
+    }
+    return rules.empty() ? "" : rules[0].target;
+}
+
+bool shorterStem(const PatternMatch &left, const PatternMatch &right)
+{
+    if (left.stem.size() != right.stem.size())
+    {
+        return left.stem.size() < right.stem.size();
+    }
+    return left.patternRule < right.patternRule;
+}
+
+// Returns every pattern rule whose target matches, shortest stem first and
+// then in definition order.
+vector<PatternMatch> findPatternCandidates(const string &target)
+{
+    vector<PatternMatch> candidates;
+    size_t node = 0;
+    size_t position = target.size();
+    while (node < suffixTrie.size())
+    {
+        for (size_t id : suffixTrie[node].patternRules)
+        {
+            PatternMatch match;
+            if (matchPattern(patternRules[id].target, target, match.stem) && !match.stem.empty())
+            {
+                match.patternRule = &patternRules[id];
+                candidates.push_back(match);
+            }
+        }
+        if (position == 0)
+        {
+            break;
+        }
+        unordered_map<char, size_t>::const_iterator child = suffixTrie[node].children.find(target[--position]);
+        if (child == suffixTrie[node].children.end())
+        {
+            break;
+        }
+        node = child->second;
+    }
+    sort(candidates.begin(), candidates.end(), shorterStem);
+    return candidates;
+}
+
+bool matchPatternRule(const string &target, vector<const PatternRule *> &chain, PatternMatch &result);
+
+bool canBeMade(const string &name, vector<const PatternRule *> &chain)
+{
+    if (findRule(name) != nullptr || fileExists(name))
+    {
+        return true;
+    }
+    if (chain.size() >= maxImplicitChain)
+    {
+        return false;
+    }
+    PatternMatch match;
+    return matchPatternRule(name, chain, match);
+}
+
+// Picks the first candidate whose prerequisites all exist, have an explicit
+// rule, or can be made by another implicit rule not already in the chain.
+bool matchPatternRule(const string &target, vector<const PatternRule *> &chain, PatternMatch &result)
+{
+    vector<PatternMatch> candidates = findPatternCandidates(target);
+    for (PatternMatch &match : candidates)
+    {
+        if (find(chain.begin(), chain.end(), match.patternRule) != chain.end())
+        {
+            continue;
+        }
+        chain.push_back(match.patternRule);
+        bool viable = true;
+        for (const string &pattern : match.patternRule->prerequisites)
+        {
+            match.prerequisites.push_back(applyPattern(pattern, match.stem));
+            viable = viable && canBeMade(match.prerequisites.back(), chain);
+        }
+        chain.pop_back();
+        if (viable)
+        {
+            result = match;
+            return true;
+        }
+    }
+    return false;
+}
+
+const PatternMatch *findPatternRule(const string &target)
+{
+    unordered_map<string, PatternMatch>::iterator found = patternMatches.find(target);
+    if (found == patternMatches.end())
+    {
+        vector<const PatternRule *> chain;
+        PatternMatch match;
+        match.patternRule = nullptr;
+        matchPatternRule(target, chain, match);
+        found = patternMatches.insert(make_pair(target, match)).first;
+    }
+    return found->second.patternRule == nullptr ? nullptr : &found->second;
+}
+
+// Discovered dependencies that can themselves be built, so that generated
+// headers are made before the objects including them.
+vector<string> buildableDependencies(const string &target)
+{
+    vector<string> result;
+    unordered_map<string, BuildRecord>::const_iterator found = buildRecords.find(target);
+    if (found == buildRecords.end())
+    {
+        return result;
+    }
+    for (const string &dependency : found->second.dependencies)
+    {
+        if (findRule(dependency) != nullptr || findPatternRule(dependency) != nullptr)
+        {
+            result.push_back(dependency);
+        }
+    }
+    return result;
+}
+
+// An explicit rule without commands still picks up an implicit recipe; its
+// prerequisites are added after the implicit ones so $< stays the source.
+Recipe resolveRecipe(const string &name)
+{
+    Recipe recipe;
+    recipe.rule = findRule(name);
+    recipe.match = nullptr;
+    recipe.commands = nullptr;
+    if (recipe.rule != nullptr)
+    {
+        recipe.commands = &recipe.rule->commands;
+        if (!recipe.rule->commands.empty())
+        {
+            recipe.prerequisites = recipe.rule->prerequisites;
+            return recipe;
+        }
+    }
+    recipe.match = findPatternRule(name);
+    if (recipe.match != nullptr)
+    {
+        recipe.commands = &recipe.match->patternRule->rule->commands;
+        recipe.prerequisites = recipe.match->prerequisites;
+        recipe.stem = recipe.match->stem;
+    }
+    if (recipe.rule != nullptr)
+    {
+        for (const string &prereq : recipe.rule->prerequisites)
+        {
+            if (find(recipe.prerequisites.begin(), recipe.prerequisites.end(), prereq) == recipe.prerequisites.end())
+            {
+                recipe.prerequisites.push_back(prereq);
+            }
+        }
+    }
+    return recipe;
+}
+
+void runRuleCommands(const vector<string> &commands, const string &target, const vector<string> &prerequisites, const string &stem, const string &debugVal, int level)
+{
+    AutomaticVariables automatic = makeAutomaticVariables(target, prerequisites, stem);
+    uint64_t commandHash = hashCommands(commands, automatic);
+    if (!needsRebuild(target, prerequisites, commandHash))
+    {
+        printUpToDate(target, level);
+        return;
+    }
+    uint64_t cacheKey;
+    if (restoreCachedTarget(target, prerequisites, commandHash, cacheKey))
+    {
+        return;
+    }
+    bool succeeded = true;
+    long long started = traceClock();
+    traceTargetStarted(target, 0);
+    OutputCapture capture;
+    beginCapture(capture, target);
+    bool remote = runsRemotely(target, prerequisites);
+    vector<string> commandLines;
+    for (const string &command : commands)
+    {
+        if (printDebugInfo)
+        {
+            printdebugInfoLine(debugVal, "Action: " + command, level);
+        }
+        if (remote)
+        {
+            commandLines.push_back(expandCommand(command, automatic));
+        }
+        else if (!executeCommand(command, automatic, capture))
+        {
+            succeeded = false;
+        }
+    }
+    if (remote)
+    {
+        int status = runRemoteTarget(target, prerequisites, commandLines, 0, &capture);
+        flushCapture(capture);
+        succeeded = checkCommandStatus(status);
+    }
+    endCapture(capture);
+    traceTargetFinished(target);
+    measuredDurations[target] = traceClock() - started;
+    if (succeeded)
+    {
+        discoverDependencies(target, prerequisites, commands, automatic);
+    }
+    recordBuild(target, prerequisites, succeeded ? commandHash : 0);
+    if (succeeded)
+    {
+        storeCachedTarget(target, cacheKey);
+    }
+}
+
+struct BuildNode
+{
+    string name;
+    string stem;
+    AutomaticVariables automatic;
+    const Rule *rule;
+    const PatternMatch *match;
+    const vector<string> *commands;
+    vector<string> prerequisites;
+    vector<int> prerequisiteIds;
+    vector<int> dependents;
+    int pendingPrerequisites;
+    size_t nextCommand;
+    vector<string> pipelines;
+    size_t nextPipeline;
+    string workingDirectory;
+    Pipeline pipeline;
+    OutputCapture capture;
+    int worker;
+    uint64_t commandHash;
+    uint64_t cacheKey;
+    int slot;
+    long long started;
+    long long priority;
+    int weight;
+    int level;
+    bool clean;
+    bool failed;
+};
+
+typedef priority_queue<pair<long long, int>> ReadyQueue;
+
+vector<BuildNode> buildNodes;
+unordered_map<string, int> buildNodeIds;
+vector<int> buildPlan;
+
+int createBuildNode(const string &name)
+{
+    unordered_map<string, int>::const_iterator found = buildNodeIds.find(name);
+    if (found != buildNodeIds.end())
+    {
+        return found->second;
+    }
+    BuildNode node;
+    node.name = name;
+    node.pendingPrerequisites = 0;
+    node.nextCommand = 0;
+    node.nextPipeline = 0;
+    node.commandHash = 0;
+    node.cacheKey = 0;
+    node.slot = 0;
+    node.started = 0;
+    node.priority = 0;
+    node.level = 0;
+    node.clean = false;
+    node.pipeline.capture = nullptr;
+    node.capture.active = false;
+    node.worker = -1;
+    unordered_map<string, int>::const_iterator weight = ruleWeights.find(name);
+    node.weight = weight == ruleWeights.end() ? 1 : min(weight->second, maxJobs);
+    node.failed = false;
+
+    Recipe recipe = resolveRecipe(name);
+    node.rule = recipe.rule;
+    node.match = recipe.match;
+    node.commands = recipe.commands;
+    node.prerequisites = recipe.prerequisites;
+    node.stem = recipe.stem;
+
+    int id = buildNodes.size();
+    buildNodes.push_back(node);
+    buildNodeIds[name] = id;
+    return id;
+}
+
+void reportCycle(const vector<int> &component, const vector<pair<int, int>> &droppedEdges)
+{
+    string chain = "";
+    for (int id : component)
+    {
+        chain += buildNodes[id].name + " -> ";
+    }
+    printdebugInfoLine("mymake", "Circular dependency: " + chain + buildNodes[component[0]].name, 0);
+    for (const pair<int, int> &edge : droppedEdges)
+    {
+        if (find(component.begin(), component.end(), edge.first) != component.end())
+        {
+            printdebugInfoLine("mymake", "  dropped " + buildNodes[edge.first].name + " -> " + buildNodes[edge.second].name, 0);
+        }
+    }
+}
+
+// Builds the dependency graph below the target in one depth-first pass that
+// is also Tarjan's SCC algorithm. Edges back into the current path close a
+// cycle and are dropped, which leaves a DAG; its post-order is the plan,
+// with every prerequisite ahead of the targets that need it. Cycles and
+// prerequisites that have no rule and do not exist are reported here, once.
+int buildGraph(const string &target)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    buildNodes.clear();
+    buildNodeIds.clear();
+    buildPlan.clear();
+
+    vector<int> order;
+    vector<int> lowlink;
+    vector<char> state;
+    vector<int> parent;
+    vector<int> tarjanStack;
+    vector<vector<string>> edgeNames;
+    vector<pair<int, int>> droppedEdges;
+    vector<pair<int, size_t>> path;
+    int counter = 0;
+    size_t edges = 0;
+    int cycles = 0;
+
+    int root = createBuildNode(target);
+    path.push_back(make_pair(root, 0));
+    while (!path.empty())
+    {
+        int id = path.back().first;
+        size_t next = path.back().second;
+        if (state.size() < buildNodes.size())
+        {
+            order.resize(buildNodes.size(), -1);
+            lowlink.resize(buildNodes.size(), -1);
+            state.resize(buildNodes.size(), 0);
+            parent.resize(buildNodes.size(), -1);
+            edgeNames.resize(buildNodes.size());
+        }
+        if (next == 0 && state[id] == 0)
+        {
+            state[id] = 1;
+            order[id] = lowlink[id] = counter++;
+            tarjanStack.push_back(id);
+            edgeNames[id] = buildNodes[id].prerequisites;
+            vector<string> dependencies = buildableDependencies(buildNodes[id].name);
+            edgeNames[id].insert(edgeNames[id].end(), dependencies.begin(), dependencies.end());
+        }
+        if (next < edgeNames[id].size())
+        {
+            path.back().second++;
+            int child = createBuildNode(edgeNames[id][next]);
+            if (child >= static_cast<int>(state.size()) || state[child] == 0)
+            {
+                buildNodes[id].prerequisiteIds.push_back(child);
+                buildNodes[child].level = buildNodes[id].level + 1;
+                path.push_back(make_pair(child, 0));
+                if (child >= static_cast<int>(parent.size()))
+                {
+                    parent.resize(child + 1, -1);
+                }
+                parent[child] = id;
+            }
+            else if (state[child] == 1)
+            {
+                droppedEdges.push_back(make_pair(id, child));
+                lowlink[id] = min(lowlink[id], order[child]);
+            }
+            else
+            {
+                buildNodes[id].prerequisiteIds.push_back(child);
+                if (state[child] == 2)
+                {
+                    lowlink[id] = min(lowlink[id], order[child]);
+                }
+            }
+            continue;
+        }
+
+        path.pop_back();
+        state[id] = 2;
+        buildPlan.push_back(id);
+        edges += buildNodes[id].prerequisiteIds.size();
+        if (!path.empty())
+        {
+            lowlink[path.back().first] = min(lowlink[path.back().first], lowlink[id]);
+        }
+        if (lowlink[id] != order[id])
+        {
+            continue;
+        }
+        vector<int> component;
+        while (true)
+        {
+            int member = tarjanStack.back();
+            tarjanStack.pop_back();
+            state[member] = 3;
+            component.push_back(member);
+            if (member == id)
+            {
+                break;
+            }
+        }
+        reverse(component.begin(), component.end());
+        bool selfLoop = find(droppedEdges.begin(), droppedEdges.end(), make_pair(id, id)) != droppedEdges.end();
+        if (component.size() > 1 || selfLoop)
+        {
+            reportCycle(component, droppedEdges);
+            cycles++;
+        }
+    }
+
+    // Every node and every header recorded for it is checked before it can
+    // run; fetch all of their states in one batch up front.
+    vector<string> paths;
+    for (int id : buildPlan)
+    {
+        paths.push_back(buildNodes[id].name);
+        unordered_map<string, BuildRecord>::const_iterator record = buildRecords.find(buildNodes[id].name);
+        if (record != buildRecords.end())
+        {
+            paths.insert(paths.end(), record->second.dependencies.begin(), record->second.dependencies.end());
+        }
+    }
+    prefetchFileStates(paths);
+
+    for (int id : buildPlan)
+    {
+        BuildNode &node = buildNodes[id];
+        node.pendingPrerequisites = node.prerequisiteIds.size();
+        for (int prereqId : node.prerequisiteIds)
+        {
+            buildNodes[prereqId].dependents.push_back(id);
+        }
+        if (node.commands == nullptr && !fileExists(node.name))
+        {
+            string neededBy = parent[id] == -1 ? "" : ", needed by '" + buildNodes[parent[id]].name + "'";
+            printdebugInfoLine("mymake", "**Target not found: '" + node.name + "'" + neededBy, 0);
+        }
+    }
+    if (printStats)
+    {
+        printdebugInfoLine("mymake", "Graph: " + to_string(buildNodes.size()) + " nodes, " + to_string(edges) + " edges, " +
+                                         to_string(cycles) + " cycles in " + to_string(elapsedMilliseconds(start)) + " ms",
+                           0);
+    }
+    return root;
+}
+
+void executePlan()
+{
+    for (int id : buildPlan)
+    {
+        BuildNode &node = buildNodes[id];
+        if (node.clean)
+        {
+            printUpToDate(node.name, node.level);
+            continue;
+        }
+        if (node.commands == nullptr)
+        {
+            continue;
+        }
+        if (printDebugInfo)
+        {
+            if (node.match != nullptr)
+            {
+                printdebugInfoLine(node.name, "Making " + node.name + " with " + node.match->patternRule->target, node.level);
+            }
+            else
+            {
+                printdebugInfoLine(node.name, "Making " + node.name, node.level);
+            }
+            if (node.rule != nullptr)
+            {
+                printRuleForTarget(*node.rule, node.level);
+            }
+        }
+        if (!node.commands->empty())
+        {
+            runRuleCommands(*node.commands, node.name, node.prerequisites, node.stem, node.name, node.level);
+        }
+        if (printDebugInfo)
+        {
+            printdebugInfoLine(node.name, "Done Making " + node.name, node.level);
+        }
+    }
+}
+
+// Estimated cost of a node's own commands: the duration recorded by the
+// last build, or on a first run the average known duration (1 ms when none
+// is known) per command plus a tenth of it per prerequisite, so links and
+// other fan-in steps sort ahead of plain compiles.
+long long estimateDuration(const BuildNode &node, long long averageDuration)
+{
+    if (node.commands == nullptr || node.commands->empty())
+    {
+        return 0;
+    }
+    unordered_map<string, BuildRecord>::const_iterator found = buildRecords.find(node.name);
+    if (found != buildRecords.end() && found->second.duration > 0)
+    {
+        return found->second.duration;
+    }
+    return averageDuration * node.commands->size() + averageDuration / 10 * node.prerequisites.size();
+}
+
+// A node's priority is the length of the longest estimated path from it to
+// the end of the build, so the start of the critical path runs first. The
+// plan is walked backwards, which visits every dependent before its
+// prerequisites.
+void prioritizeBuildNodes()
+{
+    long long total = 0;
+    long long known = 0;
+    for (const BuildNode &node : buildNodes)
+    {
+        unordered_map<string, BuildRecord>::const_iterator found = buildRecords.find(node.name);
+        if (found != buildRecords.end() && found->second.duration > 0)
+        {
+            total += found->second.duration;
+            known++;
+        }
+    }
+    long long averageDuration = known > 0 ? total / known : 1000;
+    for (size_t i = buildPlan.size(); i-- > 0;)
+    {
+        BuildNode &node = buildNodes[buildPlan[i]];
+        long long longest = 0;
+        for (int dependent : node.dependents)
+        {
+            longest = max(longest, buildNodes[dependent].priority);
+        }
+        node.priority = estimateDuration(node, averageDuration) + longest;
+    }
+}
+
+void pushReady(int id, ReadyQueue &ready)
+{
+    ready.push(make_pair(buildNodes[id].priority, -id));
+}
+
+void finishBuildNode(int id, ReadyQueue &ready)
+{
+    for (int dependent : buildNodes[id].dependents)
+    {
+        if (--buildNodes[dependent].pendingPrerequisites == 0)
+        {
+            pushReady(dependent, ready);
+        }
+    }
+}
+
+void settlePipeline(BuildNode &node)
+{
+    if (node.pipeline.exitStatus != 0)
+    {
+        flushCapture(node.capture);
+        if (node.pipeline.killedBy != 0)
+        {
+            deleteKilledTarget(node.name);
+        }
+        checkCommandStatus(node.pipeline.exitStatus);
+        node.failed = true;
+        node.nextPipeline = node.pipelines.size();
+    }
+}
+
+// Hands all of the node's commands to a forked helper that ships them to
+// the least busy worker. To the scheduler the helper is a one-stage pipeline.
+void startRemoteJob(BuildNode &node)
+{
+    vector<string> commandLines;
+    for (const string &command : *node.commands)
+    {
+        if (printDebugInfo)
+        {
+            printdebugInfoLine(node.name, "Action: " + command, 0);
+        }
+        commandLines.push_back(expandCommand(command, node.automatic));
+    }
+    node.nextCommand = node.commands->size();
+    node.pipeline.stagePids.clear();
+    node.pipeline.runningStages = 0;
+    node.pipeline.exitStatus = 0;
+    node.pipeline.killedBy = 0;
+    node.worker = min_element(remoteWorkerJobs.begin(), remoteWorkerJobs.end()) - remoteWorkerJobs.begin();
+
+    cout.flush();
+    pid_t childPid = fork();
+    if (childPid == 0)
+    {
+        if (node.capture.active)
+        {
+            dup2(node.capture.streams[0].writeFd, STDOUT_FILENO);
+            dup2(node.capture.streams[1].writeFd, STDERR_FILENO);
+        }
+        // The helper owns none of the parent's commands or job tokens: an
+        // interrupt must not make it release or kill them a second time.
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGALRM, SIG_DFL);
+        childProcesses.clear();
+        jobTokens.clear();
+        jobTokenReadFd = -1;
+        jobTokenWriteFd = -1;
+        jobserverFifo = "";
+        outputEpollFd = -1;
+        int status = runRemoteTarget(node.name, node.prerequisites, commandLines, node.worker, nullptr);
+        cout.flush();
+        _exit(status);
+    }
+    if (childPid == -1)
+    {
+        perror("Error forking remote job");
+        node.worker = -1;
+        failStage(node.pipeline, true, EXIT_FAILURE);
+        return;
+    }
+    remoteWorkerJobs[node.worker]++;
+    childProcesses.push_back(childPid);
+    traceCommandStarted(childPid, "remote " + remoteWorkers[node.worker] + ": " + node.name);
+    node.pipeline.stagePids.push_back(childPid);
+    node.pipeline.runningStages = 1;
+}
+
+// Starts the node's next pipeline, moving on to its next command once the
+// current command line is exhausted. Returns false when nothing is left.
+bool startNextPipeline(int id, unordered_map<pid_t, int> &running)
+{
+    BuildNode &node = buildNodes[id];
+    if (node.nextCommand == 0 && runsRemotely(node.name, node.prerequisites))
+    {
+        startRemoteJob(node);
+        if (node.pipeline.runningStages > 0)
+        {
+            running[node.pipeline.stagePids[0]] = id;
+            return true;
+        }
+        settlePipeline(node);
+    }
+    while (true)
+    {
+        if (node.nextPipeline >= node.pipelines.size())
+        {
+            if (node.nextCommand >= node.commands->size())
+            {
+                return false;
+            }
+            const string &command = (*node.commands)[node.nextCommand++];
+            if (printDebugInfo)
+            {
+                printdebugInfoLine(node.name, "Action: " + command, 0);
+            }
+            node.pipelines = splitCommands(expandCommand(command, node.automatic));
+            node.nextPipeline = 0;
+            node.workingDirectory = "";
+            continue;
+        }
+        startPipeline(node.pipelines[node.nextPipeline++], node.workingDirectory, node.pipeline);
+        if (node.pipeline.runningStages > 0)
+        {
+            for (pid_t childPid : node.pipeline.stagePids)
+            {
+                running[childPid] = id;
+            }
+            return true;
+        }
+        settlePipeline(node);
+    }
+}
+
+bool readLoadAverage(double &load)
+{
+    ifstream input("/proc/loadavg");
+    return static_cast<bool>(input >> load);
+}
+
+// Memory in use by our cgroup (v2 memory.current) when there is one,
+// otherwise the host's MemTotal - MemAvailable.
+bool readMemoryInUse(uint64_t &bytes)
+{
+    if (cgroupMemoryFile.empty())
+    {
+        cgroupMemoryFile = "-";
+        ifstream cgroup("/proc/self/cgroup");
+        string line;
+        while (getline(cgroup, line))
+        {
+            if (line.compare(0, 3, "0::") == 0)
+            {
+                string path = "/sys/fs/cgroup" + line.substr(3) + "/memory.current";
+                if (access(path.c_str(), R_OK) == 0)
+                {
+                    cgroupMemoryFile = path;
+                }
+            }
+        }
+    }
+    if (cgroupMemoryFile != "-")
+    {
+        ifstream current(cgroupMemoryFile.c_str());
+        if (current >> bytes)
+        {
+            return true;
+        }
+    }
+    ifstream meminfo("/proc/meminfo");
+    string key;
+    uint64_t value;
+    string unit;
+    uint64_t total = 0;
+    uint64_t available = 0;
+    bool foundAvailable = false;
+    while (meminfo >> key >> value >> unit)
+    {
+        if (key == "MemTotal:")
+        {
+            total = value * 1024;
+        }
+        else if (key == "MemAvailable:")
+        {
+            available = value * 1024;
+            foundAvailable = true;
+        }
+    }
+    if (total == 0 || !foundAvailable)
+    {
+        return false;
+    }
+    bytes = total - min(total, available);
+    return true;
+}
+
+// The load average lags behind, so jobs started within the last second are
+// added to it, as GNU make does.
+bool systemOverloaded()
+{
+    string reason = "";
+    if (loadLimit > 0)
+    {
+        long long now = traceClock();
+        while (!recentJobStarts.empty() && now - recentJobStarts.front() > 1000000)
+        {
+            recentJobStarts.pop_front();
+        }
+        double load;
+        if (readLoadAverage(load) && load + recentJobStarts.size() >= loadLimit)
+        {
+            reason = "load " + to_string(load + recentJobStarts.size()) + " >= " + to_string(loadLimit);
+        }
+    }
+    uint64_t memoryInUse;
+    if (reason.empty() && maxMemory > 0 && readMemoryInUse(memoryInUse) && memoryInUse >= maxMemory)
+    {
+        reason = "memory in use " + to_string(memoryInUse >> 20) + " MB >= " + to_string(maxMemory >> 20) + " MB";
+    }
+    if (printDebugInfo && !reason.empty() && !throttleActive)
+    {
+        printdebugInfoLine("mymake", "Throttling new jobs: " + reason, 0);
+    }
+    throttleActive = !reason.empty();
+    return throttleActive;
+}
+
+// ".WEIGHT: link=4 libbig.a=2" makes a target occupy that many -j slots,
+// so known-heavy steps do not run alongside a full set of other jobs.
+void loadRuleWeights()
+{
+    const Rule *rule = findRule(".WEIGHT");
+    if (rule == nullptr)
+    {
+        return;
+    }
+    for (const string &entry : rule->prerequisites)
+    {
+        size_t equals = entry.rfind('=');
+        int weight = equals == string::npos ? 0 : atoi(entry.c_str() + equals + 1);
+        if (weight <= 0)
+        {
+            cerr << "Error: Ignoring .WEIGHT entry " << entry << ", expected target=weight." << endl;
+            continue;
+        }
+        ruleWeights[entry.substr(0, equals)] = weight;
+    }
+}
+
+void executePlanParallel(int root)
+{
+    prioritizeBuildNodes();
+    ReadyQueue ready;
+    for (int id : buildPlan)
+    {
+        if (buildNodes[id].pendingPrerequisites == 0)
+        {
+            pushReady(id, ready);
+        }
+    }
+
+    unordered_map<pid_t, int> running;
+    vector<bool> busySlots(maxJobs, false);
+    int activeJobs = 0;
+    int held = -1;
+    while (held != -1 || !ready.empty() || activeJobs > 0)
+    {
+        bool overloaded = false;
+        bool needToken = false;
+        while (held != -1 || (activeJobs < maxJobs && !ready.empty()))
+        {
+            int id = held;
+            if (id == -1)
+            {
+                id = -ready.top().second;
+                ready.pop();
+                BuildNode &node = buildNodes[id];
+                if (node.clean)
+                {
+                    printUpToDate(node.name, id == root ? 0 : 1);
+                    finishBuildNode(id, ready);
+                    continue;
+                }
+                if (node.commands == nullptr || node.commands->empty())
+                {
+                    finishBuildNode(id, ready);
+                    continue;
+                }
+                node.automatic = makeAutomaticVariables(node.name, node.prerequisites, node.stem);
+                node.commandHash = hashCommands(*node.commands, node.automatic);
+                if (!needsRebuild(node.name, node.prerequisites, node.commandHash))
+                {
+                    printUpToDate(node.name, id == root ? 0 : 1);
+                    finishBuildNode(id, ready);
+                    continue;
+                }
+                if (restoreCachedTarget(node.name, node.prerequisites, node.commandHash, node.cacheKey))
+                {
+                    finishBuildNode(id, ready);
+                    continue;
+                }
+            }
+            BuildNode &node = buildNodes[id];
+            held = -1;
+            if (activeJobs > 0 && (activeJobs + node.weight > maxJobs || (overloaded = systemOverloaded()) ||
+                                   (needToken = !acquireJobTokens(activeJobs + node.weight - 1))))
+            {
+                held = id;
+                break;
+            }
+            // A lone job runs on our implicit token; a heavier one takes
+            // whatever extra tokens are free rather than wait for them.
+            acquireJobTokens(node.weight - 1);
+            if (printDebugInfo)
+            {
+                printdebugInfoLine(node.name, "Making " + node.name, 0);
+            }
+            node.slot = find(busySlots.begin(), busySlots.end(), false) - busySlots.begin();
+            node.started = traceClock();
+            traceTargetStarted(node.name, node.slot);
+            node.pipeline.capture = &node.capture;
+            beginCapture(node.capture, node.name);
+            if (startNextPipeline(id, running))
+            {
+                busySlots[node.slot] = true;
+                activeJobs += node.weight;
+                recentJobStarts.push_back(node.started);
+            }
+            else
+            {
+                endCapture(node.capture);
+                traceTargetFinished(node.name);
+                measuredDurations[node.name] = traceClock() - node.started;
+                if (!node.failed)
+                {
+                    discoverDependencies(node.name, node.prerequisites, *node.commands, node.automatic);
+                }
+                recordBuild(node.name, node.prerequisites, node.failed ? 0 : node.commandHash);
+                finishBuildNode(id, ready);
+            }
+        }
+        if (activeJobs == 0)
+        {
+            continue;
+        }
+
+        // While held back by load or memory, poll so that a job can start as
+        // soon as the machine frees up rather than when a running one exits.
+        int status;
+        struct rusage usage;
+        pid_t childPid = waitForChild(status, usage, overloaded ? 100 : -1, needToken ? jobTokenReadFd : -1);
+        if (childPid == 0)
+        {
+            continue;
+        }
+        if (childPid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error waiting for child");
+            return;
+        }
+        unordered_map<pid_t, int>::iterator job = running.find(childPid);
+        if (job == running.end())
+        {
+            continue;
+        }
+        int id = job->second;
+        running.erase(job);
+        BuildNode &node = buildNodes[id];
+        traceCommandFinished(childPid, usage, node.name, node.slot);
+        reapStage(node.pipeline, childPid, status);
+        if (node.pipeline.runningStages > 0)
+        {
+            continue;
+        }
+        settlePipeline(node);
+        if (!startNextPipeline(id, running))
+        {
+            if (node.worker != -1)
+            {
+                remoteWorkerJobs[node.worker]--;
+                node.worker = -1;
+            }
+            endCapture(node.capture);
+            activeJobs -= node.weight;
+            releaseJobTokens(max(activeJobs - 1, 0));
+            busySlots[node.slot] = false;
+            traceTargetFinished(node.name);
+            measuredDurations[node.name] = traceClock() - node.started;
+            if (printDebugInfo)
+            {
+                printdebugInfoLine(node.name, "Done Making " + node.name, 0);
+            }
+            if (!node.failed)
+            {
+                discoverDependencies(node.name, node.prerequisites, *node.commands, node.automatic);
+            }
+            recordBuild(node.name, node.prerequisites, node.failed ? 0 : node.commandHash);
+            if (!node.failed)
+            {
+                storeCachedTarget(node.name, node.cacheKey);
+            }
+            finishBuildNode(id, ready);
+        }
+    }
+}
+
+bool slowerTarget(const pair<string, long long> &left, const pair<string, long long> &right)
+{
+    return left.second > right.second;
+}
+
+// The critical path is the chain of prerequisites whose target times add up
+// to the longest total; targets that were up to date count as zero.
+void printTraceSummary(int root)
+{
+    if (traceFile.empty())
+    {
+        return;
+    }
+    unordered_map<string, long long> durations;
+    for (const TraceEvent &event : traceEvents)
+    {
+        if (event.category == "target")
+        {
+            durations[event.name] += event.duration;
+        }
+    }
+    vector<pair<string, long long>> slowest(durations.begin(), durations.end());
+    vector<long long> costs(buildNodes.size(), 0);
+    vector<int> next(buildNodes.size(), -1);
+    for (int id : buildPlan)
+    {
+        for (int prereqId : buildNodes[id].prerequisiteIds)
+        {
+            if (costs[prereqId] > costs[id])
+            {
+                costs[id] = costs[prereqId];
+                next[id] = prereqId;
+            }
+        }
+        costs[id] += durations[buildNodes[id].name];
+    }
+    printdebugInfoLine("mymake", "Trace written to " + traceFile, 0);
+    printdebugInfoLine("mymake", "Critical path: " + to_string(costs[root] / 1000.0) + " ms", 0);
+    for (int id = root; id != -1 && costs[id] > 0; id = next[id])
+    {
+        printdebugInfoLine("mymake", "  " + buildNodes[id].name + " " + to_string(durations[buildNodes[id].name] / 1000.0) + " ms", 0);
+    }
+    sort(slowest.begin(), slowest.end(), slowerTarget);
+    if (slowest.size() > traceSummaryCount)
+    {
+        slowest.resize(traceSummaryCount);
+    }
+    printdebugInfoLine("mymake", "Slowest targets:", 0);
+    for (const pair<string, long long> &entry : slowest)
+    {
+        printdebugInfoLine("mymake", "  " + entry.first + " " + to_string(entry.second / 1000.0) + " ms", 0);
+    }
+}
+
+string parentDirectory(const string &path)
+{
+    size_t slash = path.rfind('/');
+    if (slash == string::npos)
+    {
+        return ".";
+    }
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+string currentDirectory()
+{
+    char *cwd = getcwd(nullptr, 0);
+    string result = cwd == nullptr ? "" : cwd;
+    free(cwd);
+    return result;
+}
+
+// Directories are watched rather than files so that editors which save by
+// writing a new file and renaming it over the old one are still seen.
+void watchDirectory(const string &directory)
+{
+    if (inotifyFd == -1 || watchedDirectoryNames.count(directory) > 0)
+    {
+        return;
+    }
+    watchedDirectoryNames.insert(directory);
+    int wd = inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    if (wd == -1)
+    {
+        if (printDebugInfo)
+        {
+            printdebugInfoLine("mymake", "Cannot watch " + directory + ": " + strerror(errno), 0);
+        }
+        return;
+    }
+    watchedDirectories[wd] = directory;
+}
+
+// Drains the queued events and returns the paths they name, spelled the way
+// the makefile spells them ("dir/file", or "file" in the current directory).
+vector<string> readFileEvents(bool &existenceChanged)
+{
+    vector<string> paths;
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true)
+    {
+        ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+        if (length <= 0)
+        {
+            break;
+        }
+        for (char *cursor = buffer; cursor < buffer + length;)
+        {
+            struct inotify_event *event = reinterpret_cast<struct inotify_event *>(cursor);
+            cursor += sizeof(struct inotify_event) + event->len;
+            unordered_map<int, string>::const_iterator directory = watchedDirectories.find(event->wd);
+            if (directory == watchedDirectories.end() || event->len == 0)
+            {
+                continue;
+            }
+            if (directory->second == ".")
+            {
+                paths.push_back(event->name);
+            }
+            else
+            {
+                paths.push_back((directory->second == "/" ? "" : directory->second) + "/" + event->name);
+            }
+            if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+            {
+                existenceChanged = true;
+            }
+        }
+    }
+    return paths;
+}
+
+void noteFileEvents(const set<string> &ignored)
+{
+    bool existenceChanged = false;
+    for (const string &path : readFileEvents(existenceChanged))
+    {
+        if (ignored.count(path) > 0)
+        {
+            continue;
+        }
+        dirtyPaths.insert(path);
+        if (path == fileName)
+        {
+            makefileChanged = true;
+        }
+    }
+    if (existenceChanged)
+    {
+        patternMatches.clear();
+    }
+}
+
+void reloadMakefile()
+{
+    makefileChanged = false;
+    targets.clear();
+    rules.clear();
+    variables.clear();
+    variableExpansions.clear();
+    commandTemplates.clear();
+    patternRules.clear();
+    patternMatches.clear();
+    ruleWeights.clear();
+    knownUpToDate.clear();
+    readMakefile(fileName);
+    processPatternRules();
+    indexRules();
+    loadRuleWeights();
+    printdebugInfoLine("mymake", "Reloaded " + fileName, 0);
+}
+
+// A node is skipped when an earlier successful request found it up to date
+// and nothing it depends on, including recorded headers, has changed since.
+void markCleanNodes()
+{
+    for (int id : buildPlan)
+    {
+        BuildNode &node = buildNodes[id];
+        node.clean = knownUpToDate.count(node.name) > 0 && dirtyPaths.count(node.name) == 0 && fileExists(node.name);
+        for (int prereqId : node.prerequisiteIds)
+        {
+            node.clean = node.clean && buildNodes[prereqId].clean;
+        }
+        unordered_map<string, BuildRecord>::const_iterator record = buildRecords.find(node.name);
+        if (node.clean && record != buildRecords.end())
+        {
+            for (const string &dependency : record->second.dependencies)
+            {
+                node.clean = node.clean && dirtyPaths.count(dependency) == 0;
+            }
+        }
+    }
+}
+
+// Wall time of the executed plan (traceStart is reset just before it runs)
+// and the peak RSS of mymake itself and of its largest command.
+void printBuildStatistics()
+{
+    struct rusage self;
+    struct rusage children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    printdebugInfoLine("mymake", "Build: " + to_string(buildPlan.size()) + " targets in " + to_string(elapsedMilliseconds(traceStart)) + " ms, peak RSS " +
+                                     to_string(self.ru_maxrss) + " KB (commands " + to_string(children.ru_maxrss) + " KB)",
+                       0);
+    printdebugInfoLine("mymake", "File states: " + to_string(fileStateLookups) + " lookups, " + to_string(fileStateCalls) + " statx calls", 0);
+}
+
+void setupSignals()
+{
+    if (blockSIGINT)
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+
+        if (sigprocmask(SIG_BLOCK, &set, nullptr) == -1)
+        {
+            perror("sigprocmask");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    {
+        signal(SIGINT, handleSigInt);
+    }
+    signal(SIGALRM, handleTimeout);
+    if (timeoutSeconds > 0)
+    {
+        alarm(timeoutSeconds);
+    }
+}
+
+void runBuild()
+{
+    fileStates.clear();
+    loadBuildDatabase();
+    int root = buildGraph(target);
+    if (serverMode || watchMode)
+    {
+        markCleanNodes();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &traceStart);
+    startJobserver();
+    if (maxJobs > 1)
+    {
+        executePlanParallel(root);
+    }
+    else
+    {
+        executePlan();
+    }
+    stopJobserver();
+    if (printStats)
+    {
+        printBuildStatistics();
+    }
+    saveBuildDatabase();
+    printCacheStatistics();
+    writeTrace();
+    printTraceSummary(root);
+}
+
+// Runs one request (a client's, or a --watch round) in a forked copy of the
+// process, so that a failing command can terminate the build exactly as in a
+// normal run. The copy tells the parent what it visited: 'n' nodes, 'c' the
+// nodes a later request may skip, 'o' outputs it may have written, 'w'
+// extra files to watch, and a final "ok" when nothing failed.
+int serveBuild(const vector<string> &args, int reportFd)
+{
+    string servedFile = fileName;
+    vector<char *> argv(1, const_cast<char *>("mymake"));
+    for (const string &arg : args)
+    {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    resetOptions();
+    if (!validate(argv.size() - 1, argv.data()))
+    {
+        return 2;
+    }
+    if (fileName != servedFile || buildRulesDatabase)
+    {
+        return serverDeclined;
+    }
+    if (target.empty())
+    {
+        target = defaultTarget();
+    }
+    setupSignals();
+    runBuild();
+
+    string report = "";
+    for (int id : buildPlan)
+    {
+        const BuildNode &node = buildNodes[id];
+        report += "n" + node.name + "\n";
+        bool hasCommands = node.commands != nullptr && !node.commands->empty();
+        if (hasCommands)
+        {
+            report += "o" + node.name + "\n";
+        }
+        // Only a file can stay up to date: phony targets and recipes that
+        // leave no file behind must run on every request, as they do locally.
+        unordered_map<string, BuildRecord>::const_iterator record = buildRecords.find(node.name);
+        if (phonyTargets.count(node.name) == 0 && fileExists(node.name) && (!hasCommands || record != buildRecords.end()))
+        {
+            report += "c" + node.name + "\n";
+        }
+        if (record != buildRecords.end())
+        {
+            for (const string &dependency : record->second.dependencies)
+            {
+                report += "w" + dependency + "\n";
+            }
+        }
+    }
+    if (!buildFailed)
+    {
+        report += "ok\n";
+    }
+    size_t written = 0;
+    while (written < report.size())
+    {
+        ssize_t count = write(reportFd, report.data() + written, report.size() - written);
+        if (count <= 0)
+        {
+            break;
+        }
+        written += count;
+    }
+    return 0;
+}
+
+// Watches the directories of the files the makefile names before a round
+// starts, so that an edit made while the build runs is queued like any other.
+void watchRuleDirectories()
+{
+    for (const Rule &rule : rules)
+    {
+        if (rule.target.find('%') == string::npos)
+        {
+            watchDirectory(parentDirectory(rule.target));
+        }
+        for (const string &prereq : rule.prerequisites)
+        {
+            if (prereq.find('%') == string::npos)
             {
-                string path = myPath.substr(start, end - start);
-                string fullPath = path + '/' + filename;
-                if (access(fullPath.c_str(), F_OK) == 0)
-                {
-                    return fullPath;
-                }
-                start = end + 1;
-                end = myPath.find(':', start);
+                watchDirectory(parentDirectory(prereq));
             }
         }
-        return filename;
     }
 }
 
-void terminateChildProcesses(vector<pid_t> childProcesses)
+// The build runs in its own process group when it serves a client
+// (connection is its socket), so that the whole build, commands included, is
+// stopped if the client goes away; a client sends nothing after its request,
+// so a readable socket means it has disconnected.
+int runRequest(const vector<string> &args, const int clientFds[3], int connection)
 {
-    for (pid_t childPid : childProcesses)
+    watchRuleDirectories();
+    size_t watchedBefore = watchedDirectoryNames.size();
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) == -1)
     {
-        if (printDebugInfo)
+        perror("Error creating pipe");
+        return 2;
+    }
+    set<string> dirtySnapshot = dirtyPaths;
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("Error forking build");
+        close(report[0]);
+        close(report[1]);
+        return 2;
+    }
+    if (pid == 0)
+    {
+        if (connection != -1)
         {
-            printdebugInfoLine("mymake", "Killing child PID: " + to_string(childPid), 0);
+            setpgid(0, 0);
         }
-        kill(childPid, SIGKILL);
+        close(report[0]);
+        for (int fd = 0; fd < 3; ++fd)
+        {
+            dup2(clientFds[fd], fd);
+        }
+        int status = serveBuild(args, report[1]);
+        cout.flush();
+        exit(status);
     }
-}
-
-void terminateProcess(int parentId)
-{
-    if (printDebugInfo)
+    if (connection != -1)
     {
-        printdebugInfoLine("mymake", "Parent ID: " + to_string(parentId), 0);
-        printdebugInfoLine("mymake", "Child PIDs: " + to_string(childProcesses.size()), 0);
+        setpgid(pid, pid);
     }
-    terminateChildProcesses(childProcesses);
-    terminateChildProcesses(childProcesses2);
-    kill(parentId, SIGTERM);
-}
-
-vector<string> splitCommands(const string &command)
-{
-    vector<string> commands;
-    istringstream iss(command);
-    string singleCommand;
+    close(report[1]);
+    dirtyPaths.clear();
 
-    while (getline(iss, singleCommand, ';'))
+    string output;
+    char buffer[4096];
+    struct pollfd fds[2] = {{report[0], POLLIN, 0}, {connection, POLLIN, 0}};
+    while (true)
     {
-        // Remove leading and trailing whitespaces
-        singleCommand.erase(0, singleCommand.find_first_not_of(" \t"));
-        singleCommand.erase(singleCommand.find_last_not_of(" \t") + 1);
-
-        if (!singleCommand.empty())
+        if (poll(fds, 2, -1) == -1)
         {
-            commands.push_back(singleCommand);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0)
+        {
+            printdebugInfoLine("mymake", "Client disconnected, stopping its build", 0);
+            kill(-pid, SIGTERM);
+            fds[1].fd = -1;
+        }
+        if (fds[0].revents == 0)
+        {
+            continue;
         }
+        ssize_t count = read(report[0], buffer, sizeof(buffer));
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            break;
+        }
+        output.append(buffer, count);
     }
-
-    return commands;
-}
-vector<string> splitPipeCommands(const string &command)
-{
-    string commandCopy = command;
-    vector<string> commands;
-    size_t pos = 0;
-
-    while ((pos = commandCopy.find('|')) != string::npos)
+    close(report[0]);
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
     {
-        commands.push_back(commandCopy.substr(0, pos));
-        commandCopy.erase(0, pos + 1);
     }
+    int result = WIFEXITED(status) ? WEXITSTATUS(status) : 2;
 
-    if (!commandCopy.empty())
+    vector<string> cleanNodes;
+    set<string> outputs;
+    bool succeeded = false;
+    istringstream lines(output);
+    string line;
+    while (getline(lines, line))
     {
-        commands.push_back(commandCopy);
+        if (line == "ok")
+        {
+            succeeded = result == 0;
+        }
+        else if (line.size() > 1 && line[0] == 'n')
+        {
+            watchDirectory(parentDirectory(line.substr(1)));
+            watchedFiles.insert(line.substr(1));
+        }
+        else if (line.size() > 1 && line[0] == 'c')
+        {
+            cleanNodes.push_back(line.substr(1));
+        }
+        else if (line.size() > 1 && line[0] == 'o')
+        {
+            outputs.insert(line.substr(1));
+        }
+        else if (line.size() > 1 && line[0] == 'w')
+        {
+            watchDirectory(parentDirectory(line.substr(1)));
+            watchedFiles.insert(line.substr(1));
+        }
     }
-    return commands;
+    // Edits in a directory first watched after the build are lost, so only a
+    // round that was watched throughout can vouch for its nodes. A round is
+    // stale when it cannot, or when one of its inputs changed while it ran.
+    bool watchedThroughout = watchedDirectoryNames.size() == watchedBefore;
+    if (succeeded)
+    {
+        if (watchedThroughout)
+        {
+            knownUpToDate.insert(cleanNodes.begin(), cleanNodes.end());
+        }
+        noteFileEvents(outputs);
+    }
+    else
+    {
+        noteFileEvents(set<string>());
+    }
+    roundStale = !watchedThroughout;
+    for (const string &path : dirtyPaths)
+    {
+        roundStale = roundStale || (watchedFiles.count(path) > 0 && outputs.count(path) == 0);
+    }
+    if (!succeeded)
+    {
+        dirtyPaths.insert(dirtySnapshot.begin(), dirtySnapshot.end());
+    }
+    return result;
 }
 
-void handleChildSigInt(int signo)
+bool fillSocketAddress(struct sockaddr_un &address)
 {
-    printdebugInfoLine("mymake", "Interrupt", 0);
-    if (printDebugInfo)
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (serverSocketPath.size() >= sizeof(address.sun_path))
     {
-        printdebugInfoLine(target, "Received SIGINT signal.", 0);
+        cerr << "Error: Socket path " << serverSocketPath << " is too long." << endl;
+        return false;
     }
-    int parentId = getpid();
-    terminateProcess(parentId);
+    strcpy(address.sun_path, serverSocketPath.c_str());
+    return true;
 }
-void handleSigInt(int signo)
+
+vector<string> currentEnvironment()
 {
-    printdebugInfoLine("mymake", "Interrupt", 0);
-    if (printDebugInfo)
+    vector<string> environment;
+    for (char **entry = environ; *entry != nullptr; ++entry)
     {
-        printdebugInfoLine(target, "Received SIGINT signal.", 0);
+        environment.push_back(*entry);
     }
-    int parentId = getpid();
-    terminateProcess(parentId);
+    sort(environment.begin(), environment.end());
+    return environment;
 }
 
-void handleChildTimeout(int signo){
-    int parentId = getpid();
-    terminateProcess(parentId);
-    terminateChildProcesses(childProcesses2);
-
-}
-
-void handleTimeout(int signo)
+// Makes the server run with a client's environment, which the makefile's
+// variables, MYPATH and MAKEFLAGS are read from. The makefile is parsed
+// again under it, and nothing is known to be up to date any more.
+void adoptEnvironment(const vector<string> &environment)
 {
-    printdebugInfoLine("mymake", "Timeout Reached", 0);
-    timeoutFlag = true;
-    handleSigInt(SIGINT);
+    clearenv();
+    for (const string &entry : environment)
+    {
+        size_t equals = entry.find('=');
+        if (equals != string::npos && equals > 0)
+        {
+            setenv(entry.substr(0, equals).c_str(), entry.c_str() + equals + 1, 1);
+        }
+    }
+    searchDirectories.clear();
+    searchIndex.clear();
+    searchIndexLoaded = false;
+    reloadMakefile();
 }
 
-void executeCommand(const string &command, string target, string prerequisite)
+// A request is the client's working directory, its argument count, its
+// arguments and its environment, NUL separated, with its stdin, stdout and
+// stderr attached so that the build writes straight to the client's
+// terminal. The reply is the exit status.
+void serveClient(int listener)
 {
-
-    pid_t childPid = fork();
-
-    if (childPid == -1)
+    int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client == -1)
     {
-        perror("Error forking");
         return;
     }
-
-    if (childPid == 0)
+    vector<char> payload(65536);
+    struct iovec data = {payload.data(), payload.size()};
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t length = recvmsg(client, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *header = length > 0 ? CMSG_FIRSTHDR(&message) : nullptr;
+    int status = serverDeclined;
+    if (header != nullptr && header->cmsg_type == SCM_RIGHTS && header->cmsg_len == CMSG_LEN(3 * sizeof(int)))
     {
-        signal(SIGINT, handleChildSigInt);
-        signal(SIGALRM, handleChildTimeout);
-        vector<string> commandsSplit = splitCommands(command);
-        for (string singleCommand : commandsSplit)
-        {
-            vector<string> commands = splitPipeCommands(singleCommand);
-            ;
-            int input = -1;
-            int output = -1;
-            int pipefd[2];
-            int lastOutput = -1;
-            for (int i = 0; i < static_cast<int>(commands.size()); ++i)
-            {
-                size_t inputRedirectionPos = commands[i].find('<');
-                if (inputRedirectionPos != string::npos && commands[i].find("$<") == string::npos)
-                {
-                    string inputFile = commands[i].substr(inputRedirectionPos + 1);
-                    commands[i] = commands[i].substr(0, inputRedirectionPos);
-                    inputFile = regex_replace(inputFile, regex("^\\s+|\\s+$"), "");
-                    input = open(inputFile.c_str(), O_RDONLY);
-                    if (input == -1)
-                    {
-                        perror("Error opening input file");
-                        return;
-                    }
-                }
-
-                size_t outputRedirectionPos = commands[i].find('>');
-                string outputFile = "";
-                if (outputRedirectionPos != string::npos)
-                {
-                    outputFile = commands[i].substr(outputRedirectionPos + 1);
-                    outputFile = regex_replace(outputFile, regex("^\\s+|\\s+$"), "");
-                    commands[i] = commands[i].substr(0, outputRedirectionPos);
-                    output = open(outputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-                    if (output == -1)
-                    {
-                        perror("Error opening output file");
-                        return;
-                    }
-                }
-                bool changeDir = false;
-                if (commands[i][0] == 'c' && commands[i][1] == 'd')
-                {
-                    changeDir = true;
-                }
-                vector<char *> cmdArgs = buildCommandArgs(commands[i], target, prerequisite);
-                cmdArgs[0] = searchCommand(cmdArgs[0]);
-                // cout<<cmdArgs[1]<<endl;
-                printCommand(cmdArgs);
-                if (changeDir)
-                {
-                    if (cmdArgs.size() == 3)
-                    {
-                        if (chdir(cmdArgs[1]) != 0)
-                        {
-                            perror("Error changing directory");
-                            exit(EXIT_FAILURE);
-                        }
-                    }
-                    else
-                    {
-                        cerr << "Error: 'cd' command requires one argument (directory)." << endl;
-                    }
-                }
-                else
-                {
-                    if (pipe(pipefd) == -1)
-                    {
-                        perror("Error creating pipe");
-                        return;
-                    }
-                    pid_t childPid2 = fork();
-
-                    if (childPid2 == -1)
-                    {
-                        perror("Error forking");
-                        return;
-                    }
-
-                    if (childPid2 == 0)
-                    {
-                        signal(SIGINT, handleChildSigInt);
-                        signal(SIGALRM, handleChildTimeout);
-                        // cout<<"input: "<< input<<endl;
-                        // cout<<"pipefd[0]: "<< pipefd[0]<<endl;
-                        // cout<<"pipefd[1]: "<< pipefd[1]<<endl;
-                        // cout<<"output: "<< output<<endl;
-                        if (input != -1)
-                        {
-                            close(STDIN_FILENO);
-                            dup(input);
-                            close(input);
-                        }
-                        if (output == -1 && i < static_cast<int>(commands.size()) - 1)
-                        {
-                            close(STDOUT_FILENO);
-                            dup(pipefd[1]);
-                            close(pipefd[1]);
-                        }
-                        else if (output != -1)
-                        {
-                            close(STDOUT_FILENO);
-                            dup(output);
-                            close(output);
-                        }
-                        close(pipefd[0]);
-
-                        if (execv(cmdArgs[0], cmdArgs.data()) == -1)
-                        {
-                            perror("Error executing command");
-                            exit(EXIT_FAILURE);
-                        }
-                        exit(EXIT_SUCCESS);
-                    }
-                    else
-                    {
-                        childProcesses2.push_back(childPid2);
-                        int status;
-                        waitpid(childPid2, &status, 0);
-                        if (WIFEXITED(status))
-                        {
-                            int exitStatus = WEXITSTATUS(status);
-                            if (exitStatus != 0)
-                            {
-                                terminateChildProcesses(childProcesses2);
-                                exit(EXIT_FAILURE);
-                            }
-                        }
-                        if (i > 0)
-                        {
-                            close(input);
-                        }
-
-                        if (i < static_cast<int>(commands.size()) - 1)
-                        {
-                            input = pipefd[0];
-                        }
-                        else
-                        {
-                            lastOutput = pipefd[0];
-                        }
-                        close(pipefd[1]);
-                    }
-                }
-            }
-            char buffer[4096];
-            ssize_t bytesRead = read(lastOutput, buffer, sizeof(buffer));
-            // if(output == -1){
-            //     output = STDOUT_FILENO;
-            // }
-            write(output, buffer, bytesRead);
-
-            // Close the last output pipe
-            close(lastOutput);
-            close(output);
+        int clientFds[3];
+        memcpy(clientFds, CMSG_DATA(header), sizeof(clientFds));
+        vector<string> fields;
+        for (const char *cursor = payload.data(); cursor < payload.data() + length; cursor += fields.back().size() + 1)
+        {
+            fields.push_back(string(cursor, strnlen(cursor, payload.data() + length - cursor)));
         }
-        terminateChildProcesses(childProcesses2);
-        exit(EXIT_SUCCESS); // L1 ch
-    }
-    else
-    { // p
-        childProcesses.push_back(childPid);
-
-        int status;
-        waitpid(childPid, &status, 0);
-        if (WIFEXITED(status))
+        size_t argumentCount = fields.size() > 1 ? strtoul(fields[1].c_str(), nullptr, 10) : 0;
+        if (!(message.msg_flags & MSG_TRUNC) && fields.size() >= argumentCount + 2 && fields[0] == currentDirectory())
         {
-            int exitStatus = WEXITSTATUS(status);
-            if (exitStatus != 0)
+            vector<string> environment(fields.begin() + 2 + argumentCount, fields.end());
+            sort(environment.begin(), environment.end());
+            if (environment != currentEnvironment())
             {
-                if (continueOnError)
-                {
-                    printdebugInfoLine("mymake", "** Error code: " + to_string(WIFEXITED(status)) + ", Continue", 0);
-                }
-                else
-                {
-                    printdebugInfoLine("mymake", "** Error code: " + to_string(WIFEXITED(status)) + ", Terminate", 0);
-                    terminateProcess(getpid());
-                }
+                adoptEnvironment(environment);
             }
+            else if (makefileChanged)
+            {
+                reloadMakefile();
+            }
+            status = runRequest(vector<string>(fields.begin() + 2, fields.begin() + 2 + argumentCount), clientFds, client);
+        }
+        for (int fd : clientFds)
+        {
+            close(fd);
         }
     }
+    send(client, &status, sizeof(status), MSG_NOSIGNAL);
+    close(client);
 }
 
-vector<string> splitString(const string &input)
+int runServer()
 {
-    vector<string> result;
-    string token;
+    struct sockaddr_un address;
+    if (!fillSocketAddress(address))
+    {
+        return 1;
+    }
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listener == -1)
+    {
+        perror("Error creating server socket");
+        return 1;
+    }
+    if (connect(listener, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == 0)
+    {
+        cerr << "Error: A mymake server is already running on " << serverSocketPath << endl;
+        close(listener);
+        return 1;
+    }
+    close(listener);
+    listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink(serverSocketPath.c_str());
+    if (bind(listener, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == -1 || listen(listener, 16) == -1)
+    {
+        perror("Error binding server socket");
+        close(listener);
+        return 1;
+    }
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd == -1)
+    {
+        perror("Error initializing inotify");
+        close(listener);
+        unlink(serverSocketPath.c_str());
+        return 1;
+    }
+    watchDirectory(parentDirectory(fileName));
+    printdebugInfoLine("mymake", "Serving " + fileName + " on " + serverSocketPath, 0);
 
-    for (char ch : input)
+    while (true)
     {
-        if (ch == '.')
+        struct pollfd fds[2] = {{listener, POLLIN, 0}, {inotifyFd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1)
         {
-            if (token.size() > 0)
-                result.push_back(token);
-            result.push_back(".");
-            token.clear();
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("Error polling");
+            break;
         }
-        else if (ch == '%')
+        if (fds[1].revents & POLLIN)
         {
-            if (token.size() > 0)
-                result.push_back(token);
-            result.push_back("%");
-            token.clear();
+            noteFileEvents(set<string>());
         }
-        else
+        if (fds[0].revents & POLLIN)
         {
-            token += ch;
+            serveClient(listener);
         }
     }
-    if (token.size() > 0)
-        result.push_back(token);
-    return result;
+    close(listener);
+    unlink(serverSocketPath.c_str());
+    return 1;
 }
 
-void processGenericRules()
+// Blocks until a file the last build depended on changes, then keeps
+// collecting events until none has arrived for watchDebounceMilliseconds,
+// so that an editor's save or a checkout triggers a single rebuild.
+void waitForChanges()
 {
-    for (Rule rule : rules)
+    bool relevant = false;
+    while (!relevant && !makefileChanged)
     {
-        // cout<<rule.target<<endl;
-        vector<string> tokens = splitString(rule.target);
-        GenericRule gr;
-        while (tokens.size() > 1)
+        struct pollfd events = {inotifyFd, POLLIN, 0};
+        if (poll(&events, 1, -1) == -1 && errno != EINTR)
         {
-            // cout<<tokens.size()<<endl;
-            if (tokens[0] == ".")
-            {
-                gr.ext.push_back(tokens[1]);
-                tokens.erase(next(tokens.begin()), next(tokens.begin(), 3));
-            }
-            else if (tokens[0] == "%" && tokens[1] == ".")
+            perror("Error polling");
+            return;
+        }
+        noteFileEvents(set<string>());
+        for (set<string>::iterator path = dirtyPaths.begin(); path != dirtyPaths.end();)
+        {
+            if (watchedFiles.count(*path) > 0)
             {
-                gr.ext.push_back(tokens[2]);
-                tokens.erase(next(tokens.begin()), next(tokens.begin(), 4));
+                relevant = true;
+                ++path;
             }
             else
             {
-                break;
+                dirtyPaths.erase(path++);
             }
         }
-        if (gr.ext.size() > 0)
-        {
-            gr.target = rule.target;
-            gr.prerequisites = rule.prerequisites;
-            gr.commands = rule.commands;
-            genericRules.push_back(gr);
-        }
+    }
+    struct pollfd events = {inotifyFd, POLLIN, 0};
+    while (poll(&events, 1, watchDebounceMilliseconds) > 0)
+    {
+        noteFileEvents(set<string>());
     }
 }
 
-GenericRule matchesTarget(const string &target)
+// Rebuilds the target whenever one of its inputs changes. Each round is a
+// request to a forked copy of this process, like --server, so a failing
+// command ends that round only and the next one rebuilds just what changed.
+int runWatch(int argc, char *argv[])
 {
-    vector<string> tokens = splitString(target);
-    for (GenericRule gr : genericRules)
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd == -1)
+    {
+        perror("Error initializing inotify");
+        return 1;
+    }
+    watchDirectory(parentDirectory(fileName));
+    watchedFiles.insert(fileName);
+    vector<string> args(argv + 1, argv + argc);
+    int standardFds[3] = {0, 1, 2};
+    while (true)
     {
-        for (string ext : gr.ext)
+        if (makefileChanged)
         {
-            if (tokens[2] == ext)
-            {
-                return gr;
-            }
+            reloadMakefile();
+        }
+        runRequest(args, standardFds, -1);
+        if (roundStale)
+        {
+            // Check again, now that everything the round visited is watched.
+            continue;
         }
+        printdebugInfoLine("mymake", "Watching " + to_string(watchedFiles.size()) + " files for changes to '" + target + "'", 0);
+        waitForChanges();
     }
-    GenericRule gr;
-    return gr;
+    return 0;
 }
 
-void executeTarget(const string &target, int level, string parent)
+// Hands the build to a running --server for this directory. Returns false
+// when there is none, or it declines, and the build should run locally.
+bool requestServerBuild(int argc, char *argv[], int &status)
 {
-    string debugVal = target;
-    if (target[0] != '.' && target[0] != '%')
+    struct sockaddr_un address;
+    if (access(serverSocketPath.c_str(), F_OK) != 0 || !fillSocketAddress(address))
     {
-        if (visited.count(target) > 0)
-        {
-            return;
-        }
-        visited.insert(target);
+        return false;
     }
-    else
+    // A jobserver pipe is only open in this process, so a build that was
+    // given one stays here where it can share the parent's job slots.
+    const char *makeflags = getenv("MAKEFLAGS");
+    string auth;
+    int jobs = 0;
+    stripJobserverFlags(makeflags != nullptr ? makeflags : "", auth, jobs);
+    if (!auth.empty() && auth.compare(0, 5, "fifo:") != 0)
     {
-        debugVal = parent;
+        return false;
     }
-    for (const Rule &rule : rules)
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) == -1)
     {
-        if (rule.target == target)
+        if (fd != -1)
         {
-            if (printDebugInfo)
-            {
-                printdebugInfoLine(debugVal, "Making " + target, level);
-                printRuleForTarget(rule, level);
-            }
-            for (const string &prereq : rule.prerequisites)
-            {
-                if (visited.count(prereq) == 0)
-                {
-                    executeTarget(prereq, level + 1, target);
-                }
-            }
-            for (const string &command : rule.commands)
-            {
-                if (printDebugInfo)
-                {
-                    printdebugInfoLine(debugVal, "Action: " + command, level);
-                }
-                if (parent.size() > 0)
-                    executeCommand(command, rule.target, parent);
-                else
-                    executeCommand(command, rule.target, target);
-            }
-            if (printDebugInfo)
-            {
-                printdebugInfoLine(debugVal, "Done Making " + target, level);
-            }
-            return;
+            close(fd);
         }
+        return false;
     }
-    if (target.find(".c") != string::npos || target.find(".h") != string::npos)
+    string payload = currentDirectory();
+    payload += '\0';
+    payload += to_string(argc - 1);
+    payload += '\0';
+    for (int i = 1; i < argc; ++i)
     {
-        return;
+        payload += argv[i];
+        payload += '\0';
     }
-    GenericRule gr = matchesTarget(target);
-    if (gr.ext.size() > 0)
+    for (char **entry = environ; *entry != nullptr; ++entry)
     {
-        executeTarget(gr.target, level + 1, splitString(target)[0] + "." + gr.ext[0]);
-        return;
+        payload += *entry;
+        payload += '\0';
     }
-    else
+    int stdFds[3] = {0, 1, 2};
+    struct iovec data = {const_cast<char *>(payload.data()), payload.size()};
+    char control[CMSG_SPACE(sizeof(stdFds))];
+    memset(control, 0, sizeof(control));
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(stdFds));
+    memcpy(CMSG_DATA(header), stdFds, sizeof(stdFds));
+    cout.flush();
+    if (sendmsg(fd, &message, 0) == -1)
     {
-        printdebugInfoLine("mymake", "**Target not found", 0);
-        return;
+        close(fd);
+        return false;
+    }
+    int reply = 0;
+    ssize_t received;
+    while ((received = recv(fd, &reply, sizeof(reply), 0)) == -1 && errno == EINTR)
+    {
+    }
+    close(fd);
+    if (received != sizeof(reply))
+    {
+        cerr << "Error: Lost connection to the mymake server." << endl;
+        status = 2;
+        return true;
     }
-    return;
+    if (reply == serverDeclined)
+    {
+        return false;
+    }
+    status = reply;
+    return true;
 }
 
-
 int main(int argc, char *argv[])
 {
     if (validate(argc, argv))
     {
-        readMakefile(fileName);
-        processGenericRules();
-        // printGenericRules();
-        if (target.empty())
+        if (!workerAddress.empty())
         {
-            target = rules[0].target;
+            return runWorker();
         }
-        // printTargets();
-        // printRules();
-        // printVariables();
-        if (blockSIGINT)
+        int status;
+        if (!serverMode && !watchMode && !buildRulesDatabase && requestServerBuild(argc, argv, status))
         {
-            sigset_t set;
-            sigemptyset(&set);
-            sigaddset(&set, SIGINT);
-
-            if (sigprocmask(SIG_BLOCK, &set, nullptr) == -1)
-            {
-                perror("sigprocmask");
-                exit(EXIT_FAILURE);
-            }
+            return status;
         }
-        else
+        if (!readMakefile(fileName))
+        {
+            return 1;
+        }
+        processPatternRules();
+        indexRules();
+        loadRuleWeights();
+        // printPatternRules();
+        if (serverMode)
+        {
+            return runServer();
+        }
+        if (target.empty())
         {
-            signal(SIGINT, handleSigInt);
+            target = defaultTarget();
+            if (target.empty())
+            {
+                cerr << "Error: No targets found in " << fileName << endl;
+                return 1;
+            }
         }
-        signal(SIGALRM, handleTimeout);
-        if (timeoutSeconds > 0)
+        // printTargets();
+        // printRules();
+        // printVariables();
+        if (watchMode && !buildRulesDatabase)
         {
-            alarm(timeoutSeconds);
+            return runWatch(argc, argv);
         }
+        setupSignals();
         if (printDebugInfo)
         {
             cout << "DebugInfo: " << endl;
@@ -959,7 +6260,7 @@ int main(int argc, char *argv[])
         }
         if (!buildRulesDatabase)
         {
-            executeTarget(target, 0, "");
+            runBuild();
         }
         else
         {